@@ -0,0 +1,740 @@
+#define LOG_LEVEL_WARN
+
+#include "sys/debug.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscalls.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/profiling.h>
+#include <time.h>
+#include "sdcard.h"
+#include "globals.h"
+
+
+static struct cache_block *alloc_cache_block(block64_t block_no);
+static void free_cache_block(struct cache_block *cblk);
+static struct cache_block *cache_lookup(block64_t block_no);
+static int cache_block_cmp(const void *a, const void *b);
+static int elapsed_msec(struct timespec *ts);
+static void cache_lru_remove(struct cache_block *cblk);
+static void cache_lru_add_head(struct cache_block *cblk);
+static void cache_lru_add_tail(struct cache_block *cblk);
+static void cache_hash_remove(struct cache_block *cblk);
+static void cache_hash_add(struct cache_block *cblk);
+static int cache_hash(block64_t block_no);
+
+
+/* @brief   Allocate the block cache shared by all units
+ *
+ * @param   nentries, number of BUF_SZ entries in the cache
+ * @return  0 on success, negative errno on failure
+ *
+ * The number of hash buckets is the next power of two at or above the
+ * number of entries so that a chain holds about one entry on average.
+ */
+int init_cache(int nentries)
+{
+  int nbuckets;
+
+  if (nentries <= 0) {
+    return -EINVAL;
+  }
+
+  nbuckets = 1;
+  while (nbuckets < nentries) {
+    nbuckets <<= 1;
+  }
+
+  cache.data = mmap((void *)MMAP_START_BASE, nentries * BUF_SZ,
+                    PROT_READ | PROT_WRITE, 0, -1, 0);
+
+  if (cache.data == MAP_FAILED) {
+    return -ENOMEM;
+  }
+
+  cache.entries = calloc(nentries, sizeof (struct cache_block));
+  cache.hash = calloc(nbuckets, sizeof (struct cache_block *));
+  cache.flush_list = calloc(nentries, sizeof (struct cache_block *));
+
+  if (cache.entries == NULL || cache.hash == NULL || cache.flush_list == NULL) {
+    free(cache.entries);
+    free(cache.hash);
+    free(cache.flush_list);
+    munmap(cache.data, nentries * BUF_SZ);
+    return -ENOMEM;
+  }
+
+  cache.nentries = nentries;
+  cache.nbuckets = nbuckets;
+  cache.lru_head = NULL;
+  cache.lru_tail = NULL;
+  cache.ndirty = 0;
+
+  for (int t = 0; t < nentries; t++) {
+    cache.entries[t].data = cache.data + t * BUF_SZ;
+    cache.entries[t].valid = false;
+    cache_lru_add_tail(&cache.entries[t]);
+  }
+
+  return 0;
+}
+
+
+/* @brief   Replace the block cache with one of a different size
+ *
+ * @param   nentries, new number of BUF_SZ entries
+ * @return  0 on success, negative errno on failure with the cache unchanged
+ *
+ * Dirty blocks are written to the card first. The contents of the old
+ * cache are not carried over, the new cache starts empty.
+ */
+int resize_cache(int nentries)
+{
+  struct block_cache old;
+  int sc;
+
+  if (flush_cache() != 0) {
+    return -EIO;
+  }
+
+  old = cache;
+  sc = init_cache(nentries);
+
+  if (sc != 0) {
+    cache = old;
+    return sc;
+  }
+
+  free(old.entries);
+  free(old.hash);
+  free(old.flush_list);
+  munmap(old.data, old.nentries * BUF_SZ);
+  return 0;
+}
+
+
+/* @brief   Get a cache block, reading it from the card if not present
+ *
+ * @param   block_no, absolute block number, must be aligned to BUF_SZ
+ * @return  the cache block or NULL if it could not be read
+ *
+ * On a miss the least recently used entry is evicted and refilled.
+ * The returned block is moved to the head of the LRU list.
+ */
+struct cache_block *get_cache_block(block64_t block_no)
+{
+  struct cache_block *cblk;
+
+  cblk = find_cache_block(block_no);
+
+  if (cblk != NULL) {
+    profiling_count(cache_hit);
+    return cblk;
+  }
+
+  profiling_count(cache_miss);
+
+  cblk = alloc_cache_block(block_no);
+
+  if (cblk == NULL) {
+    return NULL;
+  }
+
+  if (bdev->read(bdev, cblk->data, BUF_SZ, block_no) < 0) {
+    log_error("sdcard: cache read failed, block:%u", (uint32_t)block_no);
+    free_cache_block(cblk);
+    return NULL;
+  }
+
+  cblk->valid = true;
+  return cblk;
+}
+
+
+/* @brief   Find a block in the cache without reading from the card
+ *
+ * @param   block_no, absolute block number, must be aligned to BUF_SZ
+ * @return  the cache block or NULL if not present
+ */
+struct cache_block *find_cache_block(block64_t block_no)
+{
+  struct cache_block *cblk;
+
+  cblk = cache_lookup(block_no);
+
+  if (cblk != NULL) {
+    cache_lru_remove(cblk);
+    cache_lru_add_head(cblk);
+  }
+
+  return cblk;
+}
+
+
+/* @brief   Read a range of blocks into the cache using multi-block reads
+ *
+ * @param   block_no, absolute block number, must be aligned to BUF_SZ
+ * @param   nchunks, number of BUF_SZ chunks to read
+ * @return  0 on success, negative errno on failure
+ *
+ * Chunks already in the cache are skipped. Each run of consecutive
+ * uncached chunks is read with a single READ_MULTIPLE_BLOCK command into
+ * xfer_buf and then copied into the cache.
+ */
+int prefetch_cache_blocks(block64_t block_no, int nchunks)
+{
+  int max_run;
+  int run;
+
+  max_run = MIN(config.xfer_size, (cache.nentries / 2) * BUF_SZ) / BUF_SZ;
+
+  if (max_run < 1) {
+    max_run = 1;
+  }
+
+  struct cache_block *run_blks[max_run];
+
+  while (nchunks > 0) {
+    if (cache_lookup(block_no) != NULL) {
+      block_no += CACHE_BLOCK_NBLOCKS;
+      nchunks--;
+      continue;
+    }
+
+    run = 1;
+    while (run < nchunks && run < max_run
+           && cache_lookup(block_no + run * CACHE_BLOCK_NBLOCKS) == NULL) {
+      run++;
+    }
+
+    // Allocate entries before reading as evicting a dirty entry uses xfer_buf
+    for (int t = 0; t < run; t++) {
+      run_blks[t] = alloc_cache_block(block_no + t * CACHE_BLOCK_NBLOCKS);
+
+      if (run_blks[t] == NULL) {
+        while (--t >= 0) {
+          free_cache_block(run_blks[t]);
+        }
+
+        return -EIO;
+      }
+    }
+
+    if (bdev->read(bdev, xfer_buf, run * BUF_SZ, block_no) < 0) {
+      log_error("sdcard: read-ahead failed, block:%u", (uint32_t)block_no);
+
+      for (int t = 0; t < run; t++) {
+        free_cache_block(run_blks[t]);
+      }
+
+      return -EIO;
+    }
+
+    profiling_count(readahead);
+
+    for (int t = 0; t < run; t++) {
+      memcpy(run_blks[t]->data, xfer_buf + t * BUF_SZ, BUF_SZ);
+      run_blks[t]->valid = true;
+    }
+
+    block_no += run * CACHE_BLOCK_NBLOCKS;
+    nchunks -= run;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Get a cache block that is about to be completely overwritten
+ *
+ * @param   block_no, absolute block number, must be aligned to BUF_SZ
+ * @return  the existing cache block or a newly allocated one, NULL if
+ *          no entry could be freed
+ *
+ * Unlike get_cache_block() a new block is not read from the card as the
+ * caller replaces all BUF_SZ bytes of its contents.
+ */
+struct cache_block *new_cache_block(block64_t block_no)
+{
+  struct cache_block *cblk;
+
+  cblk = find_cache_block(block_no);
+
+  if (cblk == NULL) {
+    cblk = alloc_cache_block(block_no);
+
+    if (cblk != NULL) {
+      cblk->valid = true;
+    }
+  }
+
+  return cblk;
+}
+
+
+/* @brief   Mark a cache block as modified in write-back mode
+ *
+ * @param   cblk, the cache block written to
+ *
+ * The time the first block became dirty is recorded so that
+ * writeback_cache() can flush blocks that have been dirty too long.
+ */
+void mark_cache_block_dirty(struct cache_block *cblk)
+{
+  if (cblk->dirty) {
+    return;
+  }
+
+  if (cache.ndirty == 0) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &cache.dirty_ts);
+  }
+
+  cblk->dirty = true;
+  cache.ndirty++;
+}
+
+
+/* @brief   Write all dirty blocks to the card
+ *
+ * @return  0 on success, -EIO if any block could not be written
+ *
+ * Dirty blocks are sorted by block number and runs of consecutive blocks
+ * are coalesced into multi-block writes of up to config.xfer_size bytes
+ * that do not cross an allocation unit boundary.
+ * Blocks that fail to be written remain dirty.
+ */
+int flush_cache(void)
+{
+  struct cache_block **list;
+  int ndirty;
+  int max_run;
+  int run;
+  int sc = 0;
+
+  if (cache.ndirty == 0) {
+    return 0;
+  }
+
+  list = cache.flush_list;
+  ndirty = 0;
+
+  for (int t = 0; t < cache.nentries; t++) {
+    if (cache.entries[t].valid && cache.entries[t].dirty) {
+      list[ndirty++] = &cache.entries[t];
+    }
+  }
+
+  qsort(list, ndirty, sizeof (struct cache_block *), cache_block_cmp);
+
+  max_run = config.xfer_size / BUF_SZ;
+
+  for (int t = 0; t < ndirty; t += run) {
+    run = 1;
+    while (t + run < ndirty && run < max_run
+           && list[t + run]->block_no == list[t]->block_no + run * CACHE_BLOCK_NBLOCKS
+           && au_limit(list[t]->block_no * 512, (run + 1) * BUF_SZ) == (run + 1) * BUF_SZ) {
+      run++;
+    }
+
+    for (int r = 0; r < run; r++) {
+      memcpy(xfer_buf + r * BUF_SZ, list[t + r]->data, BUF_SZ);
+    }
+
+    if (bdev->write(bdev, xfer_buf, run * BUF_SZ, list[t]->block_no) < 0) {
+      log_error("sdcard: write-back failed, block:%u", (uint32_t)list[t]->block_no);
+      cache.writeback_errors++;
+      sc = -EIO;
+      continue;
+    }
+
+    profiling_count(writeback);
+
+    for (int r = 0; r < run; r++) {
+      list[t + r]->dirty = false;
+      cache.ndirty--;
+    }
+  }
+
+  if (cache.ndirty > 0) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &cache.dirty_ts);
+  }
+
+  return sc;
+}
+
+
+/* @brief   Flush dirty blocks if they are too old or too numerous
+ *
+ * Called from the main loop after handling messages and when the
+ * timeout returned by writeback_timeout() expires.
+ */
+void writeback_cache(void)
+{
+  if (cache.ndirty == 0) {
+    return;
+  }
+
+  if (cache.ndirty * 100 >= cache.nentries * WRITEBACK_WATERMARK
+      || elapsed_msec(&cache.dirty_ts) >= config.writeback_delay) {
+    flush_cache();
+  }
+}
+
+
+/* @brief   Get the kevent timeout until dirty blocks must be written
+ *
+ * @return  pointer to the timeout or NULL to wait indefinitely
+ */
+struct timespec *writeback_timeout(void)
+{
+  static struct timespec timeout;
+  int msec;
+
+  if (cache.ndirty == 0) {
+    return NULL;
+  }
+
+  msec = config.writeback_delay - elapsed_msec(&cache.dirty_ts);
+
+  if (msec < 0) {
+    msec = 0;
+  }
+
+  timeout.tv_sec = msec / 1000;
+  timeout.tv_nsec = (msec % 1000) * 1000000;
+  return &timeout;
+}
+
+
+/* @brief   Update any cached copies of blocks that have been written
+ *
+ * @param   block_no, absolute block number of first 512 byte block written
+ * @param   data, the data that was written to the card
+ * @param   sz, size of data in bytes, a multiple of 512 bytes
+ *
+ * Writes go straight to the card, this keeps the cache coherent with what
+ * was written without discarding entries that were not affected.
+ */
+void update_cache_blocks(block64_t block_no, uint8_t *data, size_t sz)
+{
+  struct cache_block *cblk;
+  block64_t cblk_no;
+  off_t chunk_start;
+  size_t chunk_size;
+
+  while (sz > 0) {
+    cblk_no = rounddown(block_no, CACHE_BLOCK_NBLOCKS);
+    chunk_start = (block_no - cblk_no) * 512;
+    chunk_size = MIN(BUF_SZ - chunk_start, sz);
+
+    cblk = find_cache_block(cblk_no);
+
+    if (cblk != NULL) {
+      memcpy(cblk->data + chunk_start, data, chunk_size);
+    }
+
+    block_no += chunk_size / 512;
+    data += chunk_size;
+    sz -= chunk_size;
+  }
+}
+
+
+/* @brief   Copy cached blocks over data read directly from the card
+ *
+ * @param   block_no, absolute block number of first 512 byte block read
+ * @param   data, the data read from the card
+ * @param   sz, size of data in bytes, a multiple of 512 bytes
+ *
+ * The counterpart of update_cache_blocks() for reads that bypass the
+ * cache. Cached blocks may be dirty and newer than the card. The entries
+ * are not moved in the LRU list as the read is not a use of the cache.
+ */
+void copy_cached_blocks(block64_t block_no, uint8_t *data, size_t sz)
+{
+  struct cache_block *cblk;
+  block64_t cblk_no;
+  off_t chunk_start;
+  size_t chunk_size;
+
+  while (sz > 0) {
+    cblk_no = rounddown(block_no, CACHE_BLOCK_NBLOCKS);
+    chunk_start = (block_no - cblk_no) * 512;
+    chunk_size = MIN(BUF_SZ - chunk_start, sz);
+
+    cblk = cache_lookup(cblk_no);
+
+    if (cblk != NULL && cblk->valid) {
+      memcpy(data, cblk->data + chunk_start, chunk_size);
+    }
+
+    block_no += chunk_size / 512;
+    data += chunk_size;
+    sz -= chunk_size;
+  }
+}
+
+
+/* @brief   Discard the entire contents of the cache
+ *
+ * Dirty blocks are discarded too, call flush_cache() first to keep them.
+ */
+void invalidate_cache(void)
+{
+  for (int t = 0; t < cache.nentries; t++) {
+    if (cache.entries[t].valid) {
+      free_cache_block(&cache.entries[t]);
+    }
+
+    cache.entries[t].dirty = false;
+  }
+
+  cache.ndirty = 0;
+}
+
+
+/* @brief   Drop cached blocks in a range that has been discarded
+ *
+ * @param   block_no, absolute block number, must be aligned to BUF_SZ
+ * @param   nblocks, number of 512 byte blocks, a multiple of BUF_SZ
+ *
+ * Dirty blocks are dropped without being written, their contents are no
+ * longer wanted and writing them back would undo the discard.
+ */
+void discard_cache_blocks(block64_t block_no, block64_t nblocks)
+{
+  struct cache_block *cblk;
+
+  for (block64_t b = 0; b < nblocks; b += CACHE_BLOCK_NBLOCKS) {
+    cblk = cache_lookup(block_no + b);
+
+    if (cblk == NULL) {
+      continue;
+    }
+
+    if (cblk->dirty) {
+      cblk->dirty = false;
+      cache.ndirty--;
+    }
+
+    free_cache_block(cblk);
+  }
+}
+
+
+/* @brief   Take the least recently used entry for a new block
+ *
+ * @param   block_no, absolute block number the entry will hold
+ * @return  the entry, inserted in the hash table at the head of the LRU list,
+ *          or NULL if every entry holds dirty data that could not be written
+ *
+ * The entry is marked invalid until the caller has filled in its data.
+ * If the least recently used entry is dirty the cache is flushed first.
+ * A dirty entry is never evicted, as its write has already been
+ * acknowledged, should the flush fail the least recently used clean entry
+ * is taken instead. Entries allocated but not yet filled by the caller
+ * are skipped.
+ */
+static struct cache_block *alloc_cache_block(block64_t block_no)
+{
+  struct cache_block *cblk;
+
+  cblk = cache.lru_tail;
+
+  if (cblk->valid && cblk->dirty) {
+    flush_cache();
+
+    while (cblk != NULL && (cblk->dirty
+           || (!cblk->valid && cache_lookup(cblk->block_no) == cblk))) {
+      cblk = cblk->lru_prev;
+    }
+
+    if (cblk == NULL) {
+      log_error("sdcard: no clean cache block, block:%u", (uint32_t)block_no);
+      return NULL;
+    }
+  }
+
+  if (cblk->valid) {
+    profiling_count(cache_evict);
+    cache_hash_remove(cblk);
+    cblk->valid = false;
+  }
+
+  cblk->block_no = block_no;
+  cache_hash_add(cblk);
+
+  cache_lru_remove(cblk);
+  cache_lru_add_head(cblk);
+  return cblk;
+}
+
+
+/* @brief   Return an entry that could not be filled to the free end of the LRU
+ */
+static void free_cache_block(struct cache_block *cblk)
+{
+  cache_hash_remove(cblk);
+  cblk->valid = false;
+  cache_lru_remove(cblk);
+  cache_lru_add_tail(cblk);
+}
+
+
+/*
+ *
+ */
+static struct cache_block *cache_lookup(block64_t block_no)
+{
+  struct cache_block *cblk;
+
+  cblk = cache.hash[cache_hash(block_no)];
+
+  while (cblk != NULL) {
+    if (cblk->block_no == block_no) {
+      return cblk;
+    }
+
+    cblk = cblk->hash_next;
+  }
+
+  return NULL;
+}
+
+
+/*
+ *
+ */
+static int cache_block_cmp(const void *a, const void *b)
+{
+  const struct cache_block *ca = *(struct cache_block * const *)a;
+  const struct cache_block *cb = *(struct cache_block * const *)b;
+
+  if (ca->block_no < cb->block_no) {
+    return -1;
+  } else if (ca->block_no > cb->block_no) {
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ *
+ */
+static int elapsed_msec(struct timespec *ts)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+
+/*
+ *
+ */
+static int cache_hash(block64_t block_no)
+{
+  return (block_no / CACHE_BLOCK_NBLOCKS) & (cache.nbuckets - 1);
+}
+
+
+/*
+ *
+ */
+static void cache_hash_add(struct cache_block *cblk)
+{
+  int h = cache_hash(cblk->block_no);
+
+  cblk->hash_next = cache.hash[h];
+  cache.hash[h] = cblk;
+}
+
+
+/*
+ *
+ */
+static void cache_hash_remove(struct cache_block *cblk)
+{
+  struct cache_block **prevp;
+
+  prevp = &cache.hash[cache_hash(cblk->block_no)];
+
+  while (*prevp != NULL) {
+    if (*prevp == cblk) {
+      *prevp = cblk->hash_next;
+      break;
+    }
+
+    prevp = &(*prevp)->hash_next;
+  }
+
+  cblk->hash_next = NULL;
+}
+
+
+/*
+ *
+ */
+static void cache_lru_remove(struct cache_block *cblk)
+{
+  if (cblk->lru_prev != NULL) {
+    cblk->lru_prev->lru_next = cblk->lru_next;
+  } else {
+    cache.lru_head = cblk->lru_next;
+  }
+
+  if (cblk->lru_next != NULL) {
+    cblk->lru_next->lru_prev = cblk->lru_prev;
+  } else {
+    cache.lru_tail = cblk->lru_prev;
+  }
+
+  cblk->lru_prev = NULL;
+  cblk->lru_next = NULL;
+}
+
+
+/*
+ *
+ */
+static void cache_lru_add_head(struct cache_block *cblk)
+{
+  cblk->lru_prev = NULL;
+  cblk->lru_next = cache.lru_head;
+
+  if (cache.lru_head != NULL) {
+    cache.lru_head->lru_prev = cblk;
+  } else {
+    cache.lru_tail = cblk;
+  }
+
+  cache.lru_head = cblk;
+}
+
+
+/*
+ *
+ */
+static void cache_lru_add_tail(struct cache_block *cblk)
+{
+  cblk->lru_next = NULL;
+  cblk->lru_prev = cache.lru_tail;
+
+  if (cache.lru_tail != NULL) {
+    cache.lru_tail->lru_next = cblk;
+  } else {
+    cache.lru_head = cblk;
+  }
+
+  cache.lru_tail = cblk;
+}
+
@@ -18,6 +18,7 @@
 #include <sys/event.h>
 #include "sdcard.h"
 #include "emmc_internal.h"
+#include "mmio.h"
 #include "globals.h"
 #include <sys/rpi_mailbox.h>
 #include <sys/rpi_gpio.h>
@@ -41,6 +42,16 @@ void cmd_debug(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
   
   if (strcmp("registers", cmd) == 0) {
     cmd_debug_registers(unit, msgid, req);
+  } else if (strcmp("card", cmd) == 0) {
+    cmd_debug_card(unit, msgid, req);
+  } else if (strcmp("trace", cmd) == 0) {
+    cmd_debug_trace(unit, msgid, req);
+  } else if (strcmp("init", cmd) == 0) {
+    cmd_debug_init(unit, msgid, req);
+  } else if (strcmp("pio", cmd) == 0) {
+    cmd_debug_pio(unit, msgid, req);
+  } else if (strcmp("recovery", cmd) == 0) {
+    cmd_debug_recovery(unit, msgid, req);
   } else {
     strlcpy(resp_buf, "ERROR: unknown subcommand\n", sizeof resp_buf);
   } 
@@ -55,6 +66,11 @@ void cmd_debug_registers(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req
   char tmp[64];
   uint32_t val;
   
+  if (emmc_base == (uintptr_t)NULL) {
+    strlcpy(resp_buf, "ERROR: no controller\n", sizeof resp_buf);
+    return;
+  }
+
   strlcpy(resp_buf, "OK: registers\n", sizeof resp_buf);
   
   val = mmio_read(emmc_base + EMMC_ARG2);
@@ -170,3 +186,220 @@ void cmd_debug_registers(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req
   strlcat(resp_buf, tmp, sizeof resp_buf);
 }
 
+
+/* @brief   Report the negotiated card settings
+ *
+ */
+void cmd_debug_card(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  struct emmc_block_dev *edev = (struct emmc_block_dev *)bdev;
+
+  if (edev == NULL || strcmp(edev->bd.driver_name, driver_name) != 0
+      || edev->scr == NULL) {
+    strlcpy(resp_buf, "ERROR: no card\n", sizeof resp_buf);
+    return;
+  }
+  
+  snprintf(resp_buf, sizeof resp_buf, "OK: card\n"
+           "version    : %s\n"
+           "sdhc       : %d\n"
+           "rca        : %04lx\n"
+           "bus width  : %d-bit\n"
+           "bus mode   : %s\n"
+           "card modes : %04lx\n"
+           "stop       : %s\n"
+           "au size    : %lu KB\n"
+           "speed class: %d, uhs grade: %d\n",
+           sd_versions[edev->scr->sd_version],
+           (int)edev->card_supports_sdhc,
+           (unsigned long)edev->card_rca,
+           edev->bus_width,
+           sd_bus_modes[edev->bus_mode],
+           (unsigned long)edev->card_bus_modes,
+           (edev->auto_cmd == SD_CMD_AUTO_CMD_EN_CMD23) ? "auto-cmd23" :
+           (edev->auto_cmd == SD_CMD_AUTO_CMD_EN_CMD12) ? "auto-cmd12" : "cmd12",
+           (unsigned long)edev->au_size / 1024,
+           edev->speed_class,
+           edev->uhs_speed_grade);
+}
+
+
+/* @brief   Dump or clear the command trace ring
+ *
+ * "debug trace dump [n]" lists the last n commands, oldest first, 32 by
+ * default. "debug trace clear" empties the ring.
+ */
+void cmd_debug_trace(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+#ifdef SD_TRACE
+  struct sd_trace_entry *entry;
+  char tmp[128];
+  char *cmd;
+  char *arg;
+  unsigned int n;
+  unsigned int first;
+
+  cmd = strtok(NULL, " ");
+
+  if (cmd == NULL) {
+    strlcpy(resp_buf, "ERROR: no subcommand\n", sizeof resp_buf);
+    return;
+  }
+
+  if (strcmp("clear", cmd) == 0) {
+    sd_trace_head = 0;
+    strlcpy(resp_buf, "OK: cleared\n", sizeof resp_buf);
+    return;
+  } else if (strcmp("dump", cmd) != 0) {
+    strlcpy(resp_buf, "ERROR: unknown subcommand\n", sizeof resp_buf);
+    return;
+  }
+
+  arg = strtok(NULL, " ");
+  n = (arg != NULL) ? strtoul(arg, NULL, 0) : 32;
+  n = MIN(n, MIN(sd_trace_head, SD_TRACE_SZ));
+  first = sd_trace_head - n;
+
+  snprintf(resp_buf, sizeof resp_buf, "OK: trace, %u of %u commands\n"
+           "time              cmd    arg      blks irpt     retry ok usec\n",
+           n, sd_trace_head);
+
+  for (unsigned int t = first; t < sd_trace_head; t++) {
+    entry = &sd_trace[t % SD_TRACE_SZ];
+
+    snprintf(tmp, sizeof tmp, "%8lu.%06lu %s%-2lu %08lx %4u %08lx %5u %2u %lu\n",
+             (unsigned long)entry->start_ts.tv_sec,
+             (unsigned long)entry->start_ts.tv_nsec / 1000,
+             (entry->cmd & IS_APP_CMD) ? "ACMD" : " CMD",
+             (unsigned long)(entry->cmd & 0xff),
+             (unsigned long)entry->arg,
+             entry->blocks,
+             (unsigned long)entry->interrupt,
+             entry->retries,
+             entry->success,
+             (unsigned long)entry->usec);
+    strlcat(resp_buf, tmp, sizeof resp_buf);
+  }
+#else
+  strlcpy(resp_buf, "ERROR: trace not enabled\n", sizeof resp_buf);
+#endif
+}
+
+
+/* @brief   Report the time taken by each phase of initialization
+ *
+ */
+void cmd_debug_init(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  char tmp[64];
+  uint32_t total = 0;
+
+  snprintf(resp_buf, sizeof resp_buf, "OK: init, fast boot %s\n",
+           config.fast_boot ? "on" : "off");
+
+  for (int t = 0; t < ninit_phases; t++) {
+    snprintf(tmp, sizeof tmp, "%-20s: %8lu us\n", init_phases[t].name,
+             (unsigned long)init_phases[t].usec);
+    strlcat(resp_buf, tmp, sizeof resp_buf);
+    total += init_phases[t].usec;
+  }
+
+  snprintf(tmp, sizeof tmp, "%-20s: %8lu us\n", "total", (unsigned long)total);
+  strlcat(resp_buf, tmp, sizeof resp_buf);
+}
+
+
+/* @brief   Measure the CPU cost of programmed I/O transfers of a block
+ *
+ * Times reads of 512 byte blocks with the word at a time mmio_read() loop
+ * the driver used to use, and with mmio_read_burst() into an aligned and
+ * an unaligned buffer. The read-only EMMC_SLOTISR_VER register is used as
+ * the port so the benchmark is safe to run while the card is idle, the
+ * bus cycles to it cost the same as those to EMMC_DATA.
+ */
+void cmd_debug_pio(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  static uint32_t block[512 / 4 + 1];
+  struct timespec start_ts, end_ts;
+  char tmp[64];
+  char *arg;
+  int nblocks = 1000;
+  uint64_t nsec;
+
+  if (emmc_base == (uintptr_t)NULL) {
+    strlcpy(resp_buf, "ERROR: no controller\n", sizeof resp_buf);
+    return;
+  }
+
+  if ((arg = strtok(NULL, " ")) != NULL) {
+    nblocks = atoi(arg);
+  }
+
+  if (nblocks <= 0) {
+    strlcpy(resp_buf, "ERROR: invalid block count\n", sizeof resp_buf);
+    return;
+  }
+
+  snprintf(resp_buf, sizeof resp_buf, "OK: pio, %d blocks\n", nblocks);
+
+  for (int pass = 0; pass < 3; pass++) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+
+    for (int b = 0; b < nblocks; b++) {
+      if (pass == 0) {
+        for (int t = 0; t < 512 / 4; t++) {
+          block[t] = mmio_read(emmc_base + EMMC_SLOTISR_VER);
+        }
+      } else if (pass == 1) {
+        mmio_read_burst(emmc_base + EMMC_SLOTISR_VER, block, 512);
+      } else {
+        mmio_read_burst(emmc_base + EMMC_SLOTISR_VER, (uint8_t *)block + 1, 512);
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end_ts);
+
+    nsec = (uint64_t)(end_ts.tv_sec - start_ts.tv_sec) * 1000000000
+           + end_ts.tv_nsec - start_ts.tv_nsec;
+
+    snprintf(tmp, sizeof tmp, "%-20s: %8lu ns/block\n",
+             (pass == 0) ? "word" : (pass == 1) ? "burst" : "burst unaligned",
+             (unsigned long)(nsec / nblocks));
+    strlcat(resp_buf, tmp, sizeof resp_buf);
+  }
+}
+
+
+/* @brief   Report or clear the counters of each tier of error recovery
+ *
+ * Attempts counts the times a tier was used, recovered counts the times
+ * the command succeeded on the retry that followed it. Clock restored
+ * counts the times a stepped down clock was put back to full speed.
+ */
+void cmd_debug_recovery(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  char tmp[64];
+  char *cmd = strtok(NULL, " ");
+
+  if (cmd != NULL && strcmp("clear", cmd) == 0) {
+    memset(sd_recover_stats, 0, sizeof (struct sd_recover_stats) * SD_RECOVER_TIERS);
+    strlcpy(resp_buf, "OK: recovery cleared\n", sizeof resp_buf);
+    return;
+  } else if (cmd != NULL) {
+    strlcpy(resp_buf, "ERROR: unknown subcommand\n", sizeof resp_buf);
+    return;
+  }
+
+  strlcpy(resp_buf, "OK: recovery\n", sizeof resp_buf);
+
+  for (int t = 0; t < SD_RECOVER_TIERS; t++) {
+    snprintf(tmp, sizeof tmp, "%-16s: %8lu attempts, %8lu recovered\n",
+             sd_recover_tiers[t], (unsigned long)sd_recover_stats[t].attempts,
+             (unsigned long)sd_recover_stats[t].recovered);
+    strlcat(resp_buf, tmp, sizeof resp_buf);
+  }
+
+  snprintf(tmp, sizeof tmp, "%-16s: %8lu\n", "clock restored",
+           (unsigned long)sd_recover_stats[SD_RECOVER_CLOCK].restored);
+  strlcat(resp_buf, tmp, sizeof resp_buf);
+}
@@ -56,6 +56,12 @@
 #include "emmc_internal.h"
 
 
+static void sd_dispatch_command(struct emmc_block_dev *dev, uint32_t command,
+                                uint32_t argument, useconds_t timeout);
+static void sd_reject_command(struct emmc_block_dev *dev, uint32_t command);
+static int sd_recover(struct emmc_block_dev *edev, int tier);
+
+
 /* @brief   Internal handling of issuing SDIO command
  *
  */
@@ -66,9 +72,15 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
 
   // This is as per HCSS 3.7.1.1/3.7.2.2
   // Check Command Inhibit
-  while (mmio_read(emmc_base + EMMC_STATUS) & 0x1) {
-    delay_microsecs(10);  // FIXME: busy wait
+  SPIN_WAIT(&sw_register, (mmio_read(emmc_base + EMMC_STATUS) & 0x1) == 0, 1000000);
+  if (mmio_read(emmc_base + EMMC_STATUS) & 0x1) {
+    log_error("timeout waiting for command inhibit to clear");
+    dev->last_cmd_success = 0;
+    dev->last_interrupt = mmio_read(emmc_base + EMMC_INTERRUPT);
+    dev->last_error = dev->last_interrupt & 0xffff0000;
+    return;
   }
+
   // Is the command with busy?
   if ((cmd_reg & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B) {
     // With busy
@@ -78,29 +90,35 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
       // Not an abort command
 
       // Wait for the data line to be free
-      while (mmio_read(emmc_base + EMMC_STATUS) & 0x2) {
-        delay_microsecs(10); // FIXME: busy wait
+      SPIN_WAIT(&sw_data, (mmio_read(emmc_base + EMMC_STATUS) & 0x2) == 0, 1000000);
+      if (mmio_read(emmc_base + EMMC_STATUS) & 0x2) {
+        log_error("timeout waiting for data inhibit to clear");
+        dev->last_cmd_success = 0;
+        dev->last_interrupt = mmio_read(emmc_base + EMMC_INTERRUPT);
+        dev->last_error = dev->last_interrupt & 0xffff0000;
+        return;
       }
     }
   }
 
   // Is this a DMA transfer?
-  int is_sdma = 0;
-  if ((cmd_reg & SD_CMD_ISDATA) && (dev->use_sdma)) {
-    is_sdma = 1;
+  int is_dma = 0;
+  if ((cmd_reg & SD_CMD_ISDATA) && (dev->use_adma)) {
+    is_dma = 1;
   }
 
-  if (is_sdma) {
-    // Set system address register (ARGUMENT2 in RPi)
-    // We need to define a 4 kiB aligned buffer to use here
-    // Then convert its virtual address to a bus address
-    //mmio_write(emmc_base + EMMC_ARG2, SDMA_BUFFER_PA);
-    mmio_write(emmc_base + EMMC_ARG2, (uint32_t)buf_phys);
+  if (is_dma) {
+    // Point the controller at the descriptor table built by
+    // sd_build_adma_table() and select ADMA2
+    mmio_write(emmc_base + EMMC_ADMA_SYS_ADDR, adma_desc_phys);
+
+    uint32_t control0 = mmio_read(emmc_base + EMMC_CONTROL0);
+    control0 &= ~SD_HCTL_DMA_MASK;
+    control0 |= SD_HCTL_DMA_ADMA2;
+    mmio_write(emmc_base + EMMC_CONTROL0, control0);
   }
 
   // Set block size and block count
-  // For now, block size = 512 bytes, block count = 1,
-  //  host SDMA buffer boundary = 4 kiB
   if (dev->blocks_to_transfer > 0xffff) {
     log_warn("blocks_to_transfer too great (%i)", dev->blocks_to_transfer);
     dev->last_cmd_success = 0;
@@ -113,17 +131,26 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
   // Set argument 1 reg
   mmio_write(emmc_base + EMMC_ARG1, argument);
 
-  if (is_sdma) {
+  if (is_dma) {
     // Set Transfer mode register
     cmd_reg |= SD_CMD_DMA;
   }
 
+  // Have the host end multi-block transfers, the block count for
+  // Auto-CMD23 is passed in ARG2 (HCSS 2.2.1)
+  if ((cmd_reg & SD_CMD_ISDATA) && (cmd_reg & SD_CMD_MULTI_BLOCK)) {
+    cmd_reg |= dev->auto_cmd;
+
+    if (dev->auto_cmd == SD_CMD_AUTO_CMD_EN_CMD23) {
+      mmio_write(emmc_base + EMMC_ARG2, dev->blocks_to_transfer);
+    }
+  }
+
   // Set command reg
   mmio_write(emmc_base + EMMC_CMDTM, cmd_reg);
 
   // Wait for command complete interrupt
-  TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x8001, timeout);
-  uint32_t irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
+  uint32_t irpts = sd_wait_interrupt(0x8001, timeout);
 	
   // Clear command complete status
   mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0001);
@@ -152,7 +179,7 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
   }
 
   // If with data, wait for the appropriate interrupt
-  if ((cmd_reg & SD_CMD_ISDATA) && (is_sdma == 0)) {
+  if ((cmd_reg & SD_CMD_ISDATA) && (is_dma == 0)) {
     uint32_t wr_irpt;
     int is_write = 0;
     if (cmd_reg & SD_CMD_DAT_DIR_CH)
@@ -163,16 +190,13 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
     }
 
     int cur_block = 0;
-    uint32_t *cur_buf_addr = (uint32_t *)dev->buf;
+    uint8_t *cur_buf_addr = (uint8_t *)dev->buf;
     while (cur_block < dev->blocks_to_transfer) {
       if (dev->blocks_to_transfer > 1) {
         log_debug("multi block transfer, awaiting block %i ready", cur_block);
       }
       
-      TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & (wr_irpt | 0x8000),
-                   timeout);
-
-      irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
+      irpts = sd_wait_interrupt(wr_irpt | 0x8000, timeout);
       mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0000 | wr_irpt);
 
       if ((irpts & (0xffff0000 | wr_irpt)) != wr_irpt) {
@@ -183,23 +207,13 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
       }
 
       // Transfer the block
-      size_t cur_byte_no = 0;
       if (is_write) {
-        while (cur_byte_no < dev->block_size) {
-          uint32_t data = *cur_buf_addr;          
-          mmio_write(emmc_base + EMMC_DATA, data);
-          cur_byte_no += 4;
-          cur_buf_addr++;
-        }
+        mmio_write_burst(emmc_base + EMMC_DATA, cur_buf_addr, dev->block_size);
       } else {
-        while (cur_byte_no < dev->block_size) {
-          uint32_t data = mmio_read(emmc_base + EMMC_DATA);
-          *cur_buf_addr = data;
-          cur_byte_no += 4;
-          cur_buf_addr++;
-        }
+        mmio_read_burst(emmc_base + EMMC_DATA, cur_buf_addr, dev->block_size);
       }
 
+      cur_buf_addr += dev->block_size;
       cur_block++;
     }
   }
@@ -207,13 +221,12 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
   // Wait for transfer complete (set if read/write transfer or with busy)
   if ((((cmd_reg & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B) ||
        (cmd_reg & SD_CMD_ISDATA)) &&
-      (is_sdma == 0)) {
+      (is_dma == 0)) {
     // First check command inhibit (DAT) is not already 0
     if ((mmio_read(emmc_base + EMMC_STATUS) & 0x2) == 0)
       mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0002);
     else {
-      TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x8002, timeout);
-      irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
+      irpts = sd_wait_interrupt(0x8002, timeout);
       mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0002);
 
       // Handle the case where both data timeout and transfer complete
@@ -222,73 +235,53 @@ void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg,
         log_error("error occured whilst waiting for transfer complete "
              "interrupt");
 
+        if (irpts & SD_ERR_MASK_AUTO_CMD12) {
+          log_error("auto command error, status: %04x",
+                    mmio_read(emmc_base + EMMC_CONTROL2) & 0xffff);
+        }
+
         dev->last_error = irpts & 0xffff0000;
         dev->last_interrupt = irpts;
         return;
       }
       mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0002);
     }
-  } else if (is_sdma) {
-    // For SDMA transfers, we have to wait for either transfer complete,
-    //  DMA int or an error
-
-    // First check command inhibit (DAT) is not already 0
-    if ((mmio_read(emmc_base + EMMC_STATUS) & 0x2) == 0)
-      mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff000a);
-    else {
-      TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x800a, timeout);
-      irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
-      mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff000a);
-
-      // Detect errors
-      if ((irpts & 0x8000) && ((irpts & 0x2) != 0x2)) {
-        log_error("error occured whilst waiting for transfer complete "
-             "interrupt");
-
-        dev->last_error = irpts & 0xffff0000;
-        dev->last_interrupt = irpts;
-        return;
+  } else if (is_dma) {
+    // For ADMA2 transfers the controller walks the whole descriptor table
+    // without CPU involvement, wait for either transfer complete or an error.
+    // The descriptors do not set the INT attribute so no DMA interrupts occur.
+    irpts = sd_wait_interrupt(0x8002, timeout);
+    mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff000a);
+
+    // Transfer complete overrides data timeout: HCSS 2.2.17
+    if (((irpts & 0xffff0002) != 0x2) && ((irpts & 0xffff0002) != 0x100002)) {
+      if (irpts & SD_ERR_MASK_ADMA) {
+        log_error("ADMA error, status: %08x",
+                  mmio_read(emmc_base + EMMC_ADMA_ERR_STATUS));
+      } else if (irpts & SD_ERR_MASK_AUTO_CMD12) {
+        log_error("auto command error, status: %04x",
+                  mmio_read(emmc_base + EMMC_CONTROL2) & 0xffff);
+      } else if (irpts == 0) {
+        log_error("timeout waiting for ADMA transfer to complete");
+      } else {
+        log_error("error occured whilst waiting for ADMA transfer complete");
       }
-
-      // Detect DMA interrupt without transfer complete
-      // Currently not supported - all block sizes should fit in the
-      //  buffer
-      if ((irpts & 0x8) && ((irpts & 0x2) != 0x2)) {
-        log_error("error: DMA interrupt occured without transfer complete");
-
-        dev->last_error = irpts & 0xffff0000;
-        dev->last_interrupt = irpts;
-        return;
+      
+      if ((mmio_read(emmc_base + EMMC_STATUS) & 0x3) == 0x2) {
+        // The data transfer is ongoing, we should attempt to stop it
+        log_warn("warning: aborting transfer");
+        mmio_write(emmc_base + EMMC_CMDTM, sd_commands[STOP_TRANSMISSION]);
       }
 
-      // Detect transfer complete
-      if (irpts & 0x2) {
-        // Transfer the data to the user buffer
-#ifdef SDMA_SUPPORT
-        hal_invalidate_dcache(buf, buf + BUF_SZ);
-#endif
-        //memcpy(dev->buf, (const void *)SDMA_BUFFER, dev->block_size);
-      } else {
-        // Unknown error
-        if (irpts == 0) {
-          log_error("timeout waiting for SDMA transfer to complete");
-        } else {
-          log_error("unknown SDMA transfer error");
-        }
-        
-        if ((irpts == 0) && ((mmio_read(emmc_base + EMMC_STATUS) & 0x3) == 0x2)) {
-          // The data transfer is ongoing, we should attempt to stop it
-          log_warn("warning: aborting transfer");
-          mmio_write(emmc_base + EMMC_CMDTM, sd_commands[STOP_TRANSMISSION]);
-        }
-        dev->last_error = irpts & 0xffff0000;
-        dev->last_interrupt = irpts;
-        return;
-      }
+      dev->last_error = irpts & 0xffff0000;
+      dev->last_interrupt = irpts;
+      return;
     }
   }
 
-  // Return success
+  // Return success, keeping the status of the final wait for the trace
+  dev->last_error = 0;
+  dev->last_interrupt = irpts;
   dev->last_cmd_success = 1;
 }
 
@@ -346,34 +339,40 @@ void sd_handle_interrupts(struct emmc_block_dev *dev) {
   if (irpts & SD_BUFFER_WRITE_READY) {
     log_debug("spurious buffer write ready interrupt");
     reset_mask |= SD_BUFFER_WRITE_READY;
+    dev->card_in_tran = 0;
     sd_reset_dat();
   }
 
   if (irpts & SD_BUFFER_READ_READY) {
     log_debug("spurious buffer read ready interrupt");
     reset_mask |= SD_BUFFER_READ_READY;
+    dev->card_in_tran = 0;
     sd_reset_dat();
   }
 
   if (irpts & SD_CARD_INSERTION) {
     log_debug("card insertion detected");
     reset_mask |= SD_CARD_INSERTION;
+    dev->card_in_tran = 0;
   }
 
   if (irpts & SD_CARD_REMOVAL) {
     log_debug("card removal detected");
     reset_mask |= SD_CARD_REMOVAL;
+    dev->card_in_tran = 0;
     dev->card_removal = 1;
   }
 
   if (irpts & SD_CARD_INTERRUPT) {
     log_debug("card interrupt detected");
+    dev->card_in_tran = 0;
     sd_handle_card_interrupt(dev);
     reset_mask |= SD_CARD_INTERRUPT;
   }
 
   if (irpts & 0x8000) {
     log_warn("spurious error interrupt: %08x", irpts);
+    dev->card_in_tran = 0;
     reset_mask |= 0xffff0000;
   }
 
@@ -381,11 +380,89 @@ void sd_handle_interrupts(struct emmc_block_dev *dev) {
 }
 
 
+#ifdef SD_TRACE
+/* @brief   Record a completed command in the trace ring
+ *
+ * @param   dev, the device, last_cmd and last_interrupt describe the command
+ * @param   argument, argument of the command
+ * @param   start_ts, time sd_issue_command() was called
+ *
+ * The oldest entry is overwritten once the ring is full. Commands that
+ * were rejected before reaching the controller are recorded with an
+ * interrupt status of 0.
+ */
+static void sd_trace_command(struct emmc_block_dev *dev, uint32_t argument,
+                             struct timespec *start_ts)
+{
+  struct sd_trace_entry *entry;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  entry = &sd_trace[sd_trace_head % SD_TRACE_SZ];
+  sd_trace_head++;
+
+  entry->start_ts = *start_ts;
+  entry->usec = (now.tv_sec - start_ts->tv_sec) * 1000000
+                + (now.tv_nsec - start_ts->tv_nsec) / 1000;
+  entry->cmd = dev->last_cmd;
+  entry->arg = argument;
+  entry->interrupt = dev->last_interrupt;
+  entry->blocks = (dev->last_cmd_reg & SD_CMD_ISDATA) ? dev->blocks_to_transfer : 0;
+  entry->retries = dev->cmd_retries;
+  entry->success = dev->last_cmd_success;
+}
+#endif
+
+
 /* @brief   Send SDIO command
  *
  */
 void sd_issue_command(struct emmc_block_dev *dev, uint32_t command,
                              uint32_t argument, useconds_t timeout)
+{
+#ifdef SD_TRACE
+  struct timespec start_ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+#endif
+
+  sd_dispatch_command(dev, command, argument, timeout);
+
+  // After an error the card may have been left in any state
+  if (FAIL(dev)) {
+    dev->card_in_tran = 0;
+  }
+
+#ifdef SD_TRACE
+  sd_trace_command(dev, argument, &start_ts);
+#endif
+
+#ifdef EMMC_DEBUG
+  if (FAIL(dev)) {
+    log_error("error issuing command: interrupts %08x: ", dev->last_interrupt);
+    if (dev->last_error == 0) {
+      log_error("TIMEOUT");
+    } else {
+      for (int i = 0; i < SD_ERR_RSVD; i++) {
+        if (dev->last_error & (1 << (i + 16))) {
+          log_error("error: %s", err_irpts[i]);
+        }
+      }
+    }
+  }
+#endif
+}
+
+
+/* @brief   Issue a command, preceded by APP_CMD for an application command
+ *
+ * A command that cannot be sent fails with last_cmd_reg and
+ * last_interrupt cleared, so that it is traced as never having reached
+ * the controller.
+ */
+static void sd_dispatch_command(struct emmc_block_dev *dev, uint32_t command,
+                                uint32_t argument, useconds_t timeout)
 {
   // First, handle any pending interrupts
   sd_handle_interrupts(dev);
@@ -393,7 +470,7 @@ void sd_issue_command(struct emmc_block_dev *dev, uint32_t command,
   // Stop the command issue if it was the card remove interrupt that was
   //  handled
   if (dev->card_removal) {
-    dev->last_cmd_success = 0;
+    sd_reject_command(dev, command);
     return;
   }
 
@@ -403,7 +480,7 @@ void sd_issue_command(struct emmc_block_dev *dev, uint32_t command,
 
     if (sd_acommands[command] == SD_CMD_RESERVED(0)) {
       log_error("invalid command ACMD%i", command);
-      dev->last_cmd_success = 0;
+      sd_reject_command(dev, command | IS_APP_CMD);
       return;
     }
     dev->last_cmd = APP_CMD;
@@ -421,40 +498,54 @@ void sd_issue_command(struct emmc_block_dev *dev, uint32_t command,
   } else {
     if (sd_commands[command] == SD_CMD_RESERVED(0)) {
       log_error("invalid command CMD%i", command);
-      dev->last_cmd_success = 0;
+      sd_reject_command(dev, command);
       return;
     }
 
     dev->last_cmd = command;    
     sd_issue_command_int(dev, sd_commands[command], argument, timeout);
   }
-
-#ifdef EMMC_DEBUG
-  if (FAIL(dev)) {
-    log_error("error issuing command: interrupts %08x: ", dev->last_interrupt);
-    if (dev->last_error == 0) {
-      log_error("TIMEOUT");
-    } else {
-      for (int i = 0; i < SD_ERR_RSVD; i++) {
-        if (dev->last_error & (1 << (i + 16))) {
-          log_error("error: %s", err_irpts[i]);
-        }
-      }
-    }
-  }
-#endif
 }
 
 
 /*
  *
  */
+static void sd_reject_command(struct emmc_block_dev *dev, uint32_t command)
+{
+  dev->last_cmd = command;
+  dev->last_cmd_reg = 0;
+  dev->last_cmd_success = 0;
+  dev->last_error = 0;
+  dev->last_interrupt = 0;
+}
+
+
+/* @brief   Put the card in the transfer state ready for a data command
+ *
+ * @param   edev, the device
+ * @return  0 on success, non-zero on failure
+ *
+ * The driver is the only user of the card and every successful read or
+ * write leaves it in the transfer state. Once the state has been checked
+ * with SEND_STATUS it is only checked again after a command fails, a card
+ * interrupt occurs or the card is re-initialised, each of which clears
+ * card_in_tran.
+ */
 int sd_ensure_data_mode(struct emmc_block_dev *edev) {
   if (edev->card_rca == 0) {
-    // Try again to initialise the card
+    // Try again to initialise the card, the last tier of sd_recover()
+    sd_recover_stats[SD_RECOVER_REINIT].attempts++;
+
     int ret = sd_card_init((struct block_device **)&edev);
     if (ret != 0)
       return ret;
+
+    sd_recover_stats[SD_RECOVER_REINIT].recovered++;
+  }
+
+  if (edev->card_in_tran) {
+    return 0;
   }
 
   sd_issue_command(edev, SEND_STATUS, edev->card_rca << 16, 500000);
@@ -475,8 +566,8 @@ int sd_ensure_data_mode(struct emmc_block_dev *edev) {
       edev->card_rca = 0;
       return -1;
     }
-  } else if (cur_state == 5) {
-    // In the data transfer state - cancel the transmission
+  } else if (cur_state == 5 || cur_state == 6) {
+    // In the sending data or receive data state - cancel the transmission
     sd_issue_command(edev, STOP_TRANSMISSION, 0, 500000);
     if (FAIL(edev)) {
       log_error("ensure_data_mode() no response from CMD12");
@@ -486,6 +577,21 @@ int sd_ensure_data_mode(struct emmc_block_dev *edev) {
 
     // Reset the data circuit
     sd_reset_dat();
+  } else if (cur_state == 7) {
+    // Still programming a previous write - wait for it to finish
+    struct timer_wait prg_tw;
+    register_timer(&prg_tw, 1000000);
+    
+    do {
+      sd_issue_command(edev, SEND_STATUS, edev->card_rca << 16, 500000);
+      if (FAIL(edev)) {
+        log_error("ensure_data_mode() error sending CMD13");
+        edev->card_rca = 0;
+        return -1;
+      }
+      
+      cur_state = (edev->last_r0 >> 9) & 0xf;
+    } while (cur_state == 7 && !compare_timer(&prg_tw));
   } else if (cur_state != 4) {
     // Not in the transfer state - re-initialise
     int ret = sd_card_init((struct block_device **)&edev);
@@ -511,17 +617,102 @@ int sd_ensure_data_mode(struct emmc_block_dev *edev) {
     }
   }
 
+  edev->card_in_tran = 1;
   return 0;
 }
 
-#ifdef SDMA_SUPPORT
-// We only support DMA transfers to buffers aligned on a 4 kiB boundary
-static int sd_suitable_for_dma(void *buf) {
-  if ((uintptr_t)buf & 0xfff)
+#ifdef ADMA2_SUPPORT
+/* @brief   Check if a buffer can be transferred by ADMA2
+ *
+ * The buffer must be aligned to a cache line and be a multiple of the
+ * cache line size so that invalidating it cannot discard neighbouring data.
+ */
+static int sd_suitable_for_dma(void *buf, size_t buf_size) {
+  if ((capabilities_0 & SD_CAP_ADMA2) == 0 || adma_desc == NULL)
+    return 0;
+  if (((uintptr_t)buf & (SD_DMA_ALIGN - 1)) || (buf_size & (SD_DMA_ALIGN - 1)))
     return 0;
   else
     return 1;
 }
+
+
+/* @brief   Get the address a page is seen at by the controller's DMA
+ *
+ * @param   vaddr, page aligned virtual address
+ * @return  bus address of the page, 0 if it is not mapped
+ *
+ * The simulator in emmc_sim.c runs within the driver and accesses memory
+ * by virtual address, so it is given virtual addresses as bus addresses.
+ */
+uint32_t sd_bus_addr(void *vaddr)
+{
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    return (uint32_t)(uintptr_t)vaddr;
+  }
+#endif
+
+  return (uint32_t)virtualtophysaddr(vaddr);
+}
+
+
+/* @brief   Build the ADMA2 descriptor table for a buffer
+ *
+ * @param   buf, virtual address of the buffer
+ * @param   buf_size, size of the buffer in bytes
+ * @return  0 on success, -1 if the buffer needs too many descriptors
+ *
+ * The buffer may be physically discontiguous. Each page is translated to
+ * its physical address and physically contiguous pages are merged into a
+ * single descriptor of up to ADMA2_MAX_LEN bytes.
+ */
+int sd_build_adma_table(uint8_t *buf, size_t buf_size)
+{
+  uintptr_t vaddr = (uintptr_t)buf;
+  uint32_t paddr;
+  uint32_t page_offset;
+  size_t len;
+  size_t desc_len = 0;
+  int n = 0;
+
+  while (buf_size > 0) {
+    page_offset = vaddr & (SD_DMA_PAGE_SZ - 1);
+    len = SD_DMA_PAGE_SZ - page_offset;
+    if (len > buf_size)
+      len = buf_size;
+
+    paddr = sd_bus_addr((void *)(vaddr - page_offset));
+    if (paddr == 0)
+      return -1;
+    paddr += page_offset;
+
+    if (n > 0 && adma_desc[n - 1].addr + desc_len == paddr
+        && desc_len + len <= ADMA2_MAX_LEN) {
+      desc_len += len;
+    } else {
+      if (n == ADMA2_MAX_DESC)
+        return -1;
+
+      adma_desc[n].attr = ADMA2_VALID | ADMA2_ACT_TRAN;
+      adma_desc[n].addr = paddr;
+      desc_len = len;
+      n++;
+    }
+
+    adma_desc[n - 1].len = desc_len & 0xffff;
+    vaddr += len;
+    buf_size -= len;
+  }
+
+  if (n == 0)
+    return -1;
+
+  adma_desc[n - 1].attr |= ADMA2_END;
+
+  hal_flush_dcache(adma_desc, adma_desc + n);
+  return 0;
+}
 #endif
 
 int sd_do_data_command(struct emmc_block_dev *edev, int is_write,
@@ -551,18 +742,11 @@ int sd_do_data_command(struct emmc_block_dev *edev, int is_write,
   // Decide on the command to use
   int command;
   if (is_write) {
-#ifdef SDMA_SUPPORT
-    hal_flush_dcache(buf, buf + BUF_SZ);
-#endif
     if (edev->blocks_to_transfer > 1)
       command = WRITE_MULTIPLE_BLOCK;
     else
       command = WRITE_BLOCK;
   } else {
-#ifdef SDMA_SUPPORT
-    hal_invalidate_dcache(buf, buf + BUF_SZ);
-#endif
-    
     if (edev->blocks_to_transfer > 1)
       command = READ_MULTIPLE_BLOCK;
     else
@@ -570,41 +754,146 @@ int sd_do_data_command(struct emmc_block_dev *edev, int is_write,
   }
 
   int retry_count = 0;
-  int max_retries = 3;
+  int max_retries = 1 + SD_RECOVER_REINIT;
   while (retry_count < max_retries) {
-#ifdef SDMA_SUPPORT
-    // use SDMA for the first try only
-    if ((retry_count == 0) && sd_suitable_for_dma(buf))
-      edev->use_sdma = 1;
-    else {
-      log_info("retrying without SDMA");
-      edev->use_sdma = 0;
+#ifdef ADMA2_SUPPORT
+    // use ADMA2 for the first try only
+    if ((retry_count == 0) && sd_suitable_for_dma(buf, buf_size)
+        && sd_build_adma_table(buf, buf_size) == 0) {
+      edev->use_adma = 1;
+
+      // Write back the data to be sent, discard any lines that could be
+      // evicted over the data being received.
+      if (is_write)
+        hal_flush_dcache(buf, buf + buf_size);
+      else
+        hal_invalidate_dcache(buf, buf + buf_size);
+    } else {
+      if (retry_count > 0)
+        log_info("retrying without ADMA2");
+      edev->use_adma = 0;
     }
 #else
-    edev->use_sdma = 0;
+    edev->use_adma = 0;
 #endif
 
+    edev->cmd_retries = retry_count;
     sd_issue_command(edev, command, block_no, 5000000);
+    edev->cmd_retries = 0;
 
-    if (SUCCESS(edev))
+#ifdef ADMA2_SUPPORT
+    // Discard any lines speculatively loaded during the transfer
+    if (edev->use_adma && !is_write)
+      hal_invalidate_dcache(buf, buf + buf_size);
+#endif
+    edev->use_adma = 0;
+
+    if (SUCCESS(edev)) {
+      if (retry_count > 0)
+        sd_recover_stats[retry_count - 1].recovered++;
+
+      // Give the full clock another chance once the errors have stopped,
+      // the card is re-initialised by the next sd_ensure_data_mode() if
+      // the clock cannot be switched.
+      if (edev->clock_step > 0
+          && ++edev->clock_ok_count >= SD_RECOVER_RESTORE_AFTER
+          && sd_restore_clock(edev) != 0) {
+        edev->card_rca = 0;
+      }
       break;
-    else {
+    } else {
       log_info("error sending CMD%i, ", command);
       log_info("error = %08x.  ", edev->last_error);
+      edev->clock_ok_count = 0;
       retry_count++;
-      if (retry_count < max_retries)
+      if (retry_count < max_retries) {
         log_info("Retrying...");
-      else
+        if (sd_recover(edev, retry_count - 1) != 0) {
+          // Re-initialised by the next sd_ensure_data_mode()
+          log_error("recovery failed, card will be re-initialised");
+          edev->card_rca = 0;
+          return -1;
+        }
+      } else {
         log_error("Giving up.");
+      }
     }
   }
   if (retry_count == max_retries) {
+    // Re-initialised by the next sd_ensure_data_mode()
     edev->card_rca = 0;
     return -1;
   }
 
+  // Multi-block transfers leave the card in the sending data or receive data
+  // state until it is told to stop. Previously a multi-block write left
+  // the card in the receive data state, sd_ensure_data_mode() then found it
+  // in a state it did not handle and re-initialised the card. CMD12 is an
+  // R1b command, so for writes this is also the single wait for the card
+  // to finish programming.
+  //
+  // With Auto-CMD12 the host sends CMD12 itself, with Auto-CMD23 the card
+  // stops after the pre-defined block count. In both cases transfer
+  // complete is only raised once the card has released busy.
+  if (edev->blocks_to_transfer > 1 && edev->auto_cmd == SD_CMD_AUTO_CMD_EN_NONE) {
+    sd_issue_command(edev, STOP_TRANSMISSION, 0, 5000000);
+    if (FAIL(edev)) {
+      log_error("do_data_command() no response from CMD12");
+      edev->card_rca = 0;
+      return -1;
+    }
+  }
+
   return 0;
 }
 
 
+/* @brief   Recover from a failed data command before retrying it
+ *
+ * @param   edev, the device
+ * @param   tier, SD_RECOVER_* step of the recovery ladder
+ * @return  0 on success, -1 on failure
+ *
+ * Each retry of a command escalates to the next tier. Most failures are
+ * transient CRC errors that only need the CMD and DAT lines reset. If that
+ * is not enough, a transfer the card is still in is stopped, then the
+ * clock is halved. Only once these have failed is the card marked to be
+ * re-initialised, which includes a power cycle and takes hundreds of
+ * milliseconds. The later tiers also reset the lines.
+ */
+static int sd_recover(struct emmc_block_dev *edev, int tier)
+{
+  uint32_t cur_state;
+
+  sd_recover_stats[tier].attempts++;
+
+  if (sd_reset_cmd() != 0 || sd_reset_dat() != 0) {
+    return -1;
+  }
+
+  if (tier >= SD_RECOVER_STOP) {
+    sd_issue_command(edev, SEND_STATUS, edev->card_rca << 16, 500000);
+    if (FAIL(edev)) {
+      return -1;
+    }
+
+    cur_state = (edev->last_r0 >> 9) & 0xf;
 
+    if (cur_state == 5 || cur_state == 6) {
+      sd_issue_command(edev, STOP_TRANSMISSION, 0, 500000);
+      if (FAIL(edev)) {
+        return -1;
+      }
+
+      sd_reset_dat();
+    }
+  }
+
+  if (tier >= SD_RECOVER_CLOCK) {
+    if (sd_step_down_clock(edev) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -57,10 +57,31 @@ uint32_t hci_ver = 0;
 uint32_t capabilities_0 = 0;
 uint32_t capabilities_1 = 0;
 
+struct adma2_desc *adma_desc = NULL;    // ADMA2 descriptor table, one page
+uint32_t adma_desc_phys = 0;            // bus address of the descriptor table
+
 
 char *sd_versions[] = {"unknown", "1.0 and 1.01", "1.10",
                               "2.00",    "3.0x",         "4.xx"};
 
+char *sd_bus_modes[] = {"default", "high speed", "SDR50", "SDR104"};
+
+// AU_SIZE field of the SD Status in KB, PLSS 4.10.2.4
+uint32_t sd_au_sizes[] = {0,    16,   32,    64,    128,   256,   512,   1024,
+                          2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536};
+
+// SPEED_CLASS field of the SD Status, PLSS 4.10.2.2
+int sd_speed_classes[] = {0, 2, 4, 6, 10};
+
+char *sd_recover_tiers[] = {"reset lines", "stop transfer", "step down clock", "reinit"};
+
+struct sd_recover_stats sd_recover_stats[SD_RECOVER_TIERS];
+
+#ifdef SD_TRACE
+struct sd_trace_entry sd_trace[SD_TRACE_SZ];  // ring of the most recent commands
+unsigned int sd_trace_head = 0;               // total commands recorded
+#endif
+
 #ifdef EMMC_DEBUG
 char *err_irpts[] = {"CMD_TIMEOUT",  "CMD_CRC",       "CMD_END_BIT",
                             "CMD_INDEX",    "DATA_TIMEOUT",  "DATA_CRC",
@@ -72,7 +93,7 @@ char *err_irpts[] = {"CMD_TIMEOUT",  "CMD_CRC",       "CMD_END_BIT",
 uint32_t sd_commands[] = {
     SD_CMD_INDEX(0), SD_CMD_RESERVED(1), SD_CMD_INDEX(2) | SD_RESP_R2,
     SD_CMD_INDEX(3) | SD_RESP_R6, SD_CMD_INDEX(4), SD_CMD_INDEX(5) | SD_RESP_R4,
-    SD_CMD_INDEX(6) | SD_RESP_R1, SD_CMD_INDEX(7) | SD_RESP_R1b,
+    SD_CMD_INDEX(6) | SD_RESP_R1 | SD_DATA_READ, SD_CMD_INDEX(7) | SD_RESP_R1b,
     SD_CMD_INDEX(8) | SD_RESP_R7, SD_CMD_INDEX(9) | SD_RESP_R2,
     SD_CMD_INDEX(10) | SD_RESP_R2, SD_CMD_INDEX(11) | SD_RESP_R1,
     SD_CMD_INDEX(12) | SD_RESP_R1b | SD_CMD_TYPE_ABORT,
@@ -115,7 +136,7 @@ uint32_t sd_acommands[] = {SD_CMD_RESERVED(0),
                                   SD_CMD_RESERVED(10),
                                   SD_CMD_RESERVED(11),
                                   SD_CMD_RESERVED(12),
-                                  SD_CMD_INDEX(13) | SD_RESP_R1,
+                                  SD_CMD_INDEX(13) | SD_RESP_R1 | SD_DATA_READ,
                                   SD_CMD_RESERVED(14),
                                   SD_CMD_RESERVED(15),
                                   SD_CMD_RESERVED(16),
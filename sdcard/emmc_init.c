@@ -47,6 +47,7 @@
 #include <unistd.h>
 #include <sys/debug.h>
 #include <sys/syscalls.h>
+#include <sys/mman.h>
 #include <machine/cheviot_hal.h>
 #include "timer.h"
 #include "util.h"
@@ -60,6 +61,10 @@
  */
 int sd_card_init(struct block_device **dev)
 {
+  struct timespec phase_ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &phase_ts);
+
   // Check the sanity of the sd_commands and sd_acommands structures
   if (sd_commands_sz != (64 * sizeof(uint32_t))) {
     log_error("fatal error, sd_commands of incorrect size: %i"
@@ -75,14 +80,21 @@ int sd_card_init(struct block_device **dev)
   }
 
 #if SDHCI_IMPLEMENTATION == SDHCI_IMPLEMENTATION_BCM_2708
-// Power cycle the card to ensure its in its startup state
+// Power cycle the card to ensure its in its startup state. When fast
+// booting a card the firmware left powered is reset with CMD0 instead.
+// Re-initialisation after an error always power cycles, the driver itself
+// leaves the bus powered.
+
+  if (!(config.fast_boot && !init_done && sd_bus_powered())) {
+    if(bcm_2708_power_cycle() != 0) {
+      log_error("BCM2708 controller did not power cycle successfully");
+      return -1;
+    }
 
-  if(bcm_2708_power_cycle() != 0) {
-    log_error("BCM2708 controller did not power cycle successfully");
-    return -1;
+    log_info("BCM2708 controller power-cycled");
   }
 
-  log_info("BCM2708 controller power-cycled");
+  record_init_phase("power cycle", &phase_ts);
 #endif
 
   // Read the controller version
@@ -125,11 +137,31 @@ int sd_card_init(struct block_device **dev)
 
   log_debug("capabilities: %08x%08x", capabilities_1, capabilities_0);
 
+  record_init_phase("controller reset", &phase_ts);
+
+#ifdef ADMA2_SUPPORT
+  // Allocate the ADMA2 descriptor table, one page is enough for the
+  // largest transfer. Without it all transfers fall back to PIO.
+  if (adma_desc == NULL && (capabilities_0 & SD_CAP_ADMA2)) {
+    adma_desc = mmap((void *)MMAP_START_BASE, ADMA2_TABLE_SZ,
+                     PROT_READ | PROT_WRITE, 0, -1, 0);
+
+    if (adma_desc == MAP_FAILED) {
+      log_warn("failed to allocate ADMA2 descriptor table");
+      adma_desc = NULL;
+    } else {
+      adma_desc_phys = sd_bus_addr(adma_desc);
+    }
+  }
+#endif
+
 	// Enable SD Bus Power VDD1 at 3.3V
   uint32_t control0 = mmio_read(emmc_base + EMMC_CONTROL0);
   control0 |= 0x0F << 8;
   mmio_write(emmc_base + EMMC_CONTROL0, control0);
-  delay_microsecs(5000);
+
+  // PLSS 6.4.1 requires 1ms for the supply to ramp up
+  sd_init_delay(5000, 1000);
 
 
   // Check for a valid card
@@ -181,12 +213,13 @@ int sd_card_init(struct block_device **dev)
             mmio_read(emmc_base + EMMC_CONTROL0),
             mmio_read(emmc_base + EMMC_CONTROL1));
 
-  // Enable the SD clock
-  delay_microsecs(2000);
+  // Enable the SD clock, the card needs 74 clocks before CMD0, 185us at
+  // the identification frequency
+  sd_init_delay(2000, 0);
   control1 = mmio_read(emmc_base + EMMC_CONTROL1);
   control1 |= 4;
   mmio_write(emmc_base + EMMC_CONTROL1, control1);
-  delay_microsecs(2000);
+  sd_init_delay(2000, 200);
 
   // Mask off sending interrupts to the ARM
   //  mmio_write(emmc_base + EMMC_IRPT_EN, 0);
@@ -201,7 +234,9 @@ int sd_card_init(struct block_device **dev)
 
   mmio_write(emmc_base + EMMC_IRPT_MASK, irpt_mask);
 
-  delay_microsecs(2000);
+  sd_init_delay(2000, 0);
+
+  record_init_phase("bus power and clock", &phase_ts);
 
   // Prepare the device structure
   struct emmc_block_dev *ret;
@@ -217,6 +252,7 @@ int sd_card_init(struct block_device **dev)
   ret->bd.read = sd_read;
 #ifdef SD_WRITE_SUPPORT
   ret->bd.write = sd_write;
+  ret->bd.discard = sd_discard;
 #endif
   ret->bd.supports_multiple_block_read = 1;
   ret->bd.supports_multiple_block_write = 1;
@@ -277,6 +313,8 @@ int sd_card_init(struct block_device **dev)
     }
   }
 
+  record_init_phase("cmd0 cmd8 cmd5", &phase_ts);
+
   // Call an inquiry ACMD41 (voltage window = 0) to get the OCR
   sd_issue_command(ret, ACMD(41), 0, 500000);
   if (FAIL(ret)) {
@@ -322,11 +360,13 @@ int sd_card_init(struct block_device **dev)
 
       card_is_busy = 0;
     } else {
-      // Card is still busy
-      delay_microsecs(500000);  // FIXME: reduce delay?
+      // Card is still busy, PLSS 4.2.3 allows up to 1 second to become ready
+      sd_init_delay(500000, 5000);
     }
   }
 
+  record_init_phase("acmd41", &phase_ts);
+
 #ifdef EMMC_DEBUG
   log_info("card identified: OCR: %04x, 1.8v support: %i, SDHC support: %i",
        ret->card_ocr, ret->card_supports_18v, ret->card_supports_sdhc);
@@ -336,8 +376,10 @@ int sd_card_init(struct block_device **dev)
   // definitely support SDR12 mode which runs at 25 MHz
   sd_switch_clock_rate(base_clock, SD_CLOCK_NORMAL);
 
-  // A small wait before the voltage switch
-  delay_microsecs(20000);
+  // A small wait before the voltage switch, which is currently disabled
+  sd_init_delay(20000, 0);
+
+  record_init_phase("normal clock", &phase_ts);
 
   
 #if 0  
@@ -428,6 +470,7 @@ int sd_card_init(struct block_device **dev)
     }
 
     log_info("voltage switch complete");
+    ret->uhs_signalling = 1;
   }
 #endif
 
@@ -555,6 +598,8 @@ int sd_card_init(struct block_device **dev)
   controller_block_size |= 0x200;
   mmio_write(emmc_base + EMMC_BLKSIZECNT, controller_block_size);
 
+  record_init_phase("identify and select", &phase_ts);
+
   // Get the cards SCR register
   ret->scr = (struct sd_scr *)malloc(sizeof(struct sd_scr));
   ret->buf = &ret->scr->scr[0];
@@ -577,6 +622,7 @@ int sd_card_init(struct block_device **dev)
   uint32_t sd_spec3 = (scr0 >> (47 - 32)) & 0x1;
   uint32_t sd_spec4 = (scr0 >> (42 - 32)) & 0x1;
   ret->scr->sd_bus_widths = (scr0 >> (48 - 32)) & 0xf;
+  ret->scr->cmd23_support = (scr0 >> (33 - 32)) & 0x1;
   if (sd_spec == 0)
     ret->scr->sd_version = SD_VER_1;
   else if (sd_spec == 1)
@@ -597,31 +643,31 @@ int sd_card_init(struct block_device **dev)
   log_debug("SCR: %08x%08x", byte_swap(ret->scr->scr[0]), byte_swap(ret->scr->scr[1]));
   log_debug("SCR: version %s, bus_widths %01x", sd_versions[ret->scr->sd_version], ret->scr->sd_bus_widths);
 
-#ifdef SD_4BIT_DATA
-  if (ret->scr->sd_bus_widths & 0x4) {
-    // Set 4-bit transfer mode (ACMD6)
-    // See HCSS 3.4 for the algorithm
+#ifdef SD_AUTO_CMD
+  // Auto-CMD23 needs a version 3.00 host, HCSS 2.2.14
+  if (ret->scr->cmd23_support && hci_ver >= 2) {
+    ret->auto_cmd = SD_CMD_AUTO_CMD_EN_CMD23;
+  } else {
+    ret->auto_cmd = SD_CMD_AUTO_CMD_EN_CMD12;
+  }
+#else
+  ret->auto_cmd = SD_CMD_AUTO_CMD_EN_NONE;
+#endif
+
+  record_init_phase("scr", &phase_ts);
 
-    // Disable card interrupt in host
-    uint32_t old_irpt_mask = mmio_read(emmc_base + EMMC_IRPT_MASK);
-    uint32_t new_iprt_mask = old_irpt_mask & ~(1 << 8);
-    mmio_write(emmc_base + EMMC_IRPT_MASK, new_iprt_mask);
+  // Use the 4-bit data bus if the card supports it, stays 1-bit on failure
+  sd_set_bus_width(ret);
+  record_init_phase("bus width", &phase_ts);
 
-    // Send ACMD6 to change the card's bit mode
-    sd_issue_command(ret, SET_BUS_WIDTH, 0x2, 500000);
-    if (FAIL(ret)) {
-      log_warn("switch to 4-bit data mode failed");
-    } else {
-      // Change bit mode for Host
-      uint32_t control0 = mmio_read(emmc_base + EMMC_CONTROL0);
-      control0 |= 0x2;
-      mmio_write(emmc_base + EMMC_CONTROL0, control0);
+  // Negotiate the fastest bus speed, stays at SD_CLOCK_NORMAL on failure
+  sd_set_bus_speed(ret);
+  record_init_phase("bus speed", &phase_ts);
 
-      // Re-enable card interrupt in host
-      mmio_write(emmc_base + EMMC_IRPT_MASK, old_irpt_mask);
-    }
-  }
-#endif
+  // Get the allocation unit size, writes are not AU aligned on failure
+  sd_read_sd_status(ret);
+  ret->bd.au_size = ret->au_size;
+  record_init_phase("sd status", &phase_ts);
 
   log_info("found a valid version %s SD card", sd_versions[ret->scr->sd_version]);
   log_info("setup successful (status %i)", status);
@@ -64,14 +64,14 @@
 // Enable 1.8V support
 // #define SD_1_8V_SUPPORT
 
-// Enable 4-bit support
-#define SD_4BIT_DATA
-
 // SD Clock Frequencies (in Hz)
 
 #define SD_CLOCK_ID         400000
 #define SD_RPI_BASE_CLOCK 41666666
 #define SD_CLOCK_NORMAL   25000000
+#define SD_CLOCK_HIGH     50000000
+#define SD_CLOCK_SDR50   100000000
+#define SD_CLOCK_SDR104  208000000
 
 #define BASE_CLOCK_RPI_DEFAULT        0
 #define BASE_CLOCK_EMMC_CAPABILITIES  1
@@ -83,8 +83,16 @@
 // Requires 150 mA power so disabled on the RPi for now
 //#define SDXC_MAXIMUM_PERFORMANCE
 
-// Enable SDMA support
-//#define SDMA_SUPPORT
+// Enable ADMA2 scatter-gather DMA support
+#define ADMA2_SUPPORT
+
+// End multi-block transfers with Auto-CMD23 or Auto-CMD12 instead of
+// sending STOP_TRANSMISSION after the transfer
+#define SD_AUTO_CMD
+
+// Record each command issued in the sd_trace ring, see debug trace
+#define SD_TRACE
+#define SD_TRACE_SZ       256
 
 // Enable card interrupts
 //#define SD_CARD_INTERRUPTS
@@ -102,6 +110,33 @@ struct sd_scr {
   uint32_t scr[2];
   uint32_t sd_bus_widths;
   int sd_version;
+  int cmd23_support;
+};
+
+// ADMA2 32-bit descriptor, see HCSS 1.13.4
+struct adma2_desc {
+  uint16_t attr;
+  uint16_t len;                     // 0 means 65536 bytes
+  uint32_t addr;
+};
+
+// Counters of a recovery tier
+struct sd_recover_stats {
+  uint32_t attempts;
+  uint32_t recovered;               // next attempt of the command succeeded
+  uint32_t restored;                // SD_RECOVER_CLOCK only, clock was restored
+};
+
+// Entry of the command trace ring
+struct sd_trace_entry {
+  struct timespec start_ts;
+  uint32_t usec;                    // time from issue to completion
+  uint32_t cmd;                     // command index, IS_APP_CMD for ACMDs
+  uint32_t arg;
+  uint32_t interrupt;               // final EMMC_INTERRUPT value
+  uint16_t blocks;
+  uint8_t retries;
+  uint8_t success;
 };
 
 struct emmc_block_dev {
@@ -116,6 +151,20 @@ struct emmc_block_dev {
   struct sd_scr *scr;
 
   int failed_voltage_switch;
+  int uhs_signalling;           // card and host switched to 1.8V signalling
+
+  int bus_width;                // data bus width in bits, 1 or 4
+  int bus_mode;                 // SD_BUS_MODE_* selected by sd_set_bus_speed()
+  int clock_step;               // times the clock was halved by sd_step_down_clock()
+  uint32_t clock_ok_count;      // data commands that succeeded since the clock was halved
+  uint32_t card_bus_modes;      // group 1 access modes supported by the card
+
+  uint32_t au_size;             // allocation unit in bytes from the SD Status, 0 if unknown
+  int speed_class;              // speed class, 0 if not specified
+  int uhs_speed_grade;          // UHS speed grade, 0 if below U1
+  uint32_t erase_size;          // AUs erased in erase_timeout, 0 if no estimate
+  uint32_t erase_timeout;       // seconds to erase erase_size AUs
+  uint32_t erase_offset;        // seconds added to each erase
 
   uint32_t last_cmd_reg;
   uint32_t last_cmd;
@@ -128,8 +177,11 @@ struct emmc_block_dev {
   void *buf;
   int blocks_to_transfer;
   size_t block_size;
-  int use_sdma;
+  int use_adma;
+  uint32_t auto_cmd;            // SD_CMD_AUTO_CMD_EN_* for multi-block transfers
+  int cmd_retries;              // retries of the current data command, for the trace
   int card_removal;
+  int card_in_tran;             // card known to be in the transfer state, see sd_ensure_data_mode()
   uint32_t base_clock;
 };
 
@@ -152,6 +204,8 @@ struct emmc_block_dev {
 #define EMMC_CAPABILITIES_0 0x40
 #define EMMC_CAPABILITIES_1 0x44
 #define EMMC_FORCE_IRPT 0x50
+#define EMMC_ADMA_ERR_STATUS 0x54
+#define EMMC_ADMA_SYS_ADDR 0x58
 #define EMMC_BOOT_TIMEOUT 0x70
 #define EMMC_DBG_SEL 0x74
 #define EMMC_EXRDFIFO_CFG 0x80
@@ -208,8 +262,8 @@ struct emmc_block_dev {
 #define SD_ERR_MASK_DATA_CRC (1 << (16 + SD_ERR_CMD_CRC))
 #define SD_ERR_MASK_DATA_END_BIT (1 << (16 + SD_ERR_CMD_END_BIT))
 #define SD_ERR_MASK_CURRENT_LIMIT (1 << (16 + SD_ERR_CMD_CURRENT_LIMIT))
-#define SD_ERR_MASK_AUTO_CMD12 (1 << (16 + SD_ERR_CMD_AUTO_CMD12))
-#define SD_ERR_MASK_ADMA (1 << (16 + SD_ERR_CMD_ADMA))
+#define SD_ERR_MASK_AUTO_CMD12 (1 << (16 + SD_ERR_AUTO_CMD12))
+#define SD_ERR_MASK_ADMA (1 << (16 + SD_ERR_ADMA))
 #define SD_ERR_MASK_TUNING (1 << (16 + SD_ERR_CMD_TUNING))
 
 #define SD_COMMAND_COMPLETE 1
@@ -307,6 +361,86 @@ struct emmc_block_dev {
 #define SET_CLR_CARD_DETECT (42 | IS_APP_CMD)
 #define SEND_SCR (51 | IS_APP_CMD)
 
+// Host control (CONTROL0) DMA select field
+#define SD_HCTL_DMA_MASK (3 << 3)
+#define SD_HCTL_DMA_SDMA (0 << 3)
+#define SD_HCTL_DMA_ADMA2 (2 << 3)
+
+// Host control (CONTROL0) data transfer width and high speed enable
+#define SD_HCTL_DWIDTH_4 (1 << 1)
+#define SD_HCTL_HS_EN (1 << 2)
+
+// SCR bus widths field
+#define SD_SCR_BUS_WIDTH_1 (1 << 0)
+#define SD_SCR_BUS_WIDTH_4 (1 << 2)
+
+// Host control 2 (upper half of CONTROL2), HCSS 2.2.39
+#define SD_CTRL2_UHS_MASK (7 << 16)
+#define SD_CTRL2_UHS_SDR12 (0 << 16)
+#define SD_CTRL2_UHS_SDR25 (1 << 16)
+#define SD_CTRL2_UHS_SDR50 (2 << 16)
+#define SD_CTRL2_UHS_SDR104 (3 << 16)
+#define SD_CTRL2_EXEC_TUNING (1 << 22)
+#define SD_CTRL2_SAMPLE_CLK (1 << 23)
+
+#define SD_TUNING_MAX_LOOPS 40
+
+// Erase, PLSS 4.14. Without the SD Status erase fields the host allows
+// 250ms per block erased, ranges are split to keep each timeout bounded.
+#define SD_ERASE_TIMEOUT_PER_BLOCK 250000
+#define SD_ERASE_MAX_BLOCKS 2048
+
+// SD Status, 512 bits read with ACMD13, PLSS 4.10.2
+#define SD_STATUS_SZ 64
+
+// Tiers of recovery from a failed data command, tried in order before
+// the command is retried, see sd_recover()
+#define SD_RECOVER_RESET    0       // reset the CMD and DAT lines
+#define SD_RECOVER_STOP     1       // stop a transfer the card is still in
+#define SD_RECOVER_CLOCK    2       // halve the SD clock
+#define SD_RECOVER_REINIT   3       // re-initialise the card
+#define SD_RECOVER_TIERS    4
+
+// Lowest clock rate the SD_RECOVER_CLOCK tier steps down to
+#define SD_RECOVER_MIN_CLOCK  6250000
+
+// Data commands that must succeed before a stepped down clock is restored
+#define SD_RECOVER_RESTORE_AFTER  1000
+
+// Capabilities
+#define SD_CAP_ADMA2 (1 << 19)
+#define SD_CAP_HIGH_SPEED (1 << 21)
+#define SD_CAP1_SDR50 (1 << 0)
+#define SD_CAP1_SDR104 (1 << 1)
+#define SD_CAP1_SDR50_TUNING (1 << 13)
+
+// Bus speed modes, the CMD6 function group 1 function numbers
+#define SD_BUS_MODE_DEFAULT 0           // SDR12 at 1.8V
+#define SD_BUS_MODE_HIGH 1              // SDR25 at 1.8V
+#define SD_BUS_MODE_SDR50 2
+#define SD_BUS_MODE_SDR104 3
+
+// CMD6 SWITCH_FUNC arguments
+#define SD_SWITCH_CHECK 0
+#define SD_SWITCH_SET (1 << 31)
+#define SD_SWITCH_NO_CHANGE 0xf
+#define SD_SWITCH_GROUP1(f) (0x00fffff0 | (f))
+
+// ADMA2 descriptor attributes
+#define ADMA2_VALID (1 << 0)
+#define ADMA2_END (1 << 1)
+#define ADMA2_INT (1 << 2)
+#define ADMA2_ACT_NOP (0 << 4)
+#define ADMA2_ACT_TRAN (2 << 4)
+#define ADMA2_ACT_LINK (3 << 4)
+
+#define ADMA2_MAX_LEN 65536             // Largest length of a single descriptor
+#define ADMA2_TABLE_SZ 4096             // Size of descriptor table, one page
+#define ADMA2_MAX_DESC (ADMA2_TABLE_SZ / sizeof(struct adma2_desc))
+
+#define SD_DMA_PAGE_SZ 4096
+#define SD_DMA_ALIGN 64                 // Cache line size, DMA buffers must be aligned
+
 #define SD_RESET_CMD (1 << 25)
 #define SD_RESET_DAT (1 << 26)
 #define SD_RESET_ALL (1 << 24)
@@ -323,8 +457,21 @@ extern uint32_t hci_ver;
 extern uint32_t capabilities_0;
 extern uint32_t capabilities_1;
 
+extern struct adma2_desc *adma_desc;
+extern uint32_t adma_desc_phys;
+
 
 extern char *sd_versions[];
+extern char *sd_bus_modes[];
+extern uint32_t sd_au_sizes[];
+extern int sd_speed_classes[];
+extern char *sd_recover_tiers[];
+extern struct sd_recover_stats sd_recover_stats[];
+
+#ifdef SD_TRACE
+extern struct sd_trace_entry sd_trace[];
+extern unsigned int sd_trace_head;
+#endif
 
 #ifdef EMMC_DEBUG
 extern char *err_irpts[];
@@ -344,6 +491,7 @@ extern size_t sd_acommands_sz;
 
 int sd_read(struct block_device *, uint8_t *, size_t buf_size, uint32_t);
 int sd_write(struct block_device *, uint8_t *, size_t buf_size, uint32_t);
+int sd_discard(struct block_device *, uint32_t block_no, uint32_t nblocks);
 int sd_do_data_command(struct emmc_block_dev *edev, int is_write,
                               uint8_t *buf, size_t buf_size,
                               uint32_t block_no);                              
@@ -352,9 +500,19 @@ int sd_switch_clock_rate(uint32_t base_clock, uint32_t target_rate);
 uint32_t sd_get_clock_divider(uint32_t base_clock, uint32_t freq);
 int sd_reset_cmd(void);
 int sd_reset_dat(void);
+uint32_t sd_wait_interrupt(uint32_t mask, unsigned int usec);
+void sd_init_delay(unsigned int usec, unsigned int fast_usec);
+int sd_bus_powered(void);
 void sd_issue_command(struct emmc_block_dev *dev, uint32_t command,
                              uint32_t argument, useconds_t timeout);
 uint32_t sd_get_base_clock_hz(void);
+uint32_t sd_bus_addr(void *vaddr);
+int sd_build_adma_table(uint8_t *buf, size_t buf_size);
+int sd_set_bus_speed(struct emmc_block_dev *dev);
+int sd_set_bus_width(struct emmc_block_dev *dev);
+int sd_read_sd_status(struct emmc_block_dev *dev);
+int sd_step_down_clock(struct emmc_block_dev *dev);
+int sd_restore_clock(struct emmc_block_dev *dev);
 
 
 #endif
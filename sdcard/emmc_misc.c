@@ -47,6 +47,8 @@
 #include <unistd.h>
 #include <sys/debug.h>
 #include <sys/syscalls.h>
+#include <sys/event.h>
+#include <sys/interrupts.h>
 #include <machine/cheviot_hal.h>
 #include "timer.h"
 #include "util.h"
@@ -310,7 +312,7 @@ int sd_switch_clock_rate(uint32_t base_clock, uint32_t target_rate) {
   uint32_t control1 = mmio_read(emmc_base + EMMC_CONTROL1);
   control1 &= ~(1 << 2);
   mmio_write(emmc_base + EMMC_CONTROL1, control1);
-  delay_microsecs(2000);
+  sd_init_delay(2000, 0);
 
   // Write the new divider
   control1 &= ~(0x3FF << 6);  // Clear old setting + clock generator select
@@ -318,12 +320,22 @@ int sd_switch_clock_rate(uint32_t base_clock, uint32_t target_rate) {
   control1 |= divider;
   
   mmio_write(emmc_base + EMMC_CONTROL1, control1);
-  delay_microsecs(2000);
+
+  if (config.fast_boot) {
+    TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_CONTROL1) & 0x2, 2000);
+  } else {
+    delay_microsecs(2000);
+  }
+
+  if ((mmio_read(emmc_base + EMMC_CONTROL1) & 0x2) == 0) {
+    log_error("controller's clock did not stabilise within 2ms");
+    return -1;
+  }
 
   // Enable the SD clock
   control1 |= (1 << 2);
   mmio_write(emmc_base + EMMC_CONTROL1, control1);
-  delay_microsecs(2000);
+  sd_init_delay(2000, 0);
 
   log_info("set clock rate to %i Hz", target_rate);
   return 0;
@@ -331,6 +343,39 @@ int sd_switch_clock_rate(uint32_t base_clock, uint32_t target_rate) {
 
 
 
+/* @brief   Wait a fixed interval during initialization
+ *
+ * @param   usec, interval normally waited
+ * @param   fast_usec, interval waited when fast booting, 0 for none
+ *
+ * The normal intervals are generous, in fast boot mode the minimum the
+ * specifications require is used and readiness is polled for instead.
+ */
+void sd_init_delay(unsigned int usec, unsigned int fast_usec)
+{
+  if (config.fast_boot) {
+    usec = fast_usec;
+  }
+
+  if (usec > 0) {
+    delay_microsecs(usec);
+  }
+}
+
+
+/* @brief   Check if the SD bus is already powered
+ *
+ * @return  1 if the firmware left bus power on with a card inserted
+ */
+int sd_bus_powered(void)
+{
+  uint32_t control0 = mmio_read(emmc_base + EMMC_CONTROL0);
+  uint32_t status = mmio_read(emmc_base + EMMC_STATUS);
+
+  return ((control0 & (1 << 8)) && (status & (1 << 16))) ? 1 : 0;
+}
+
+
 /* @brief   Reset the CMD line
  *
  */
@@ -364,3 +409,76 @@ int sd_reset_dat(void) {
   return 0;
 }
 
+
+/* @brief   Wait for any of a set of interrupt status bits to be set
+ *
+ * @param   mask, bits of EMMC_INTERRUPT to wait for
+ * @param   usec, timeout in microseconds
+ * @return  contents of EMMC_INTERRUPT when the wait ended
+ *
+ * The status is first busy-polled for the budget learned by sw_command
+ * or sw_data, quick completions are then seen without the cost of the
+ * interrupt and a reschedule. Only the bits in mask and the error bits
+ * are enabled to raise the interrupt. The status is checked before
+ * unmasking so a completion that occurs before or during the unmask still
+ * raises the interrupt as it is level triggered. The interrupt is left
+ * masked on return, the caller clears the status bits it has handled.
+ * Falls back to polling if the interrupt could not be routed to this
+ * driver.
+ */
+uint32_t sd_wait_interrupt(uint32_t mask, unsigned int usec)
+{
+  struct timer_wait irq_tw;
+  struct timespec now;
+  struct timespec remaining;
+  struct kevent ev;
+  uint32_t irpts;
+  int nevents;
+  
+  struct spin_wait *sw = (mask & SD_COMMAND_COMPLETE) ? &sw_command : &sw_data;
+  struct spin_wait_state ws;
+
+  if (irq_kq < 0) {
+    SPIN_WAIT(sw, mmio_read(emmc_base + EMMC_INTERRUPT) & mask, usec);
+    return mmio_read(emmc_base + EMMC_INTERRUPT);
+  }
+
+  // Busy-poll for completions quicker than taking the interrupt
+  spin_wait_begin(&ws, sw, usec);
+
+  while ((irpts = mmio_read(emmc_base + EMMC_INTERRUPT) & mask) == 0
+         && spin_wait_spinning(&ws));
+
+  if (irpts != 0) {
+    spin_wait_end(&ws, true);
+    return mmio_read(emmc_base + EMMC_INTERRUPT);
+  }
+
+  mmio_write(emmc_base + EMMC_IRPT_EN, mask | EMMC_IRPT_ERROR_MASK);
+  register_timer(&irq_tw, (ws.elapsed_usec < usec) ? usec - ws.elapsed_usec : 0);
+  
+  while ((irpts = mmio_read(emmc_base + EMMC_INTERRUPT) & mask) == 0) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    
+    if (diff_timespec(&remaining, &now, &irq_tw.expire_ts)) {
+      log_warn("timeout waiting for interrupt: %08x", mask);
+      break;
+    }
+
+    if (interrupt_masked == true) {
+      interrupt_masked = false;
+      unmaskinterrupt(emmc_irq);
+    }
+    
+    nevents = kevent(irq_kq, NULL, 0, &ev, 1, &remaining);
+
+    if (nevents == 1 && ev.filter == EVFILT_THREAD_EVENT
+        && (ev.fflags & (1<<EVENT_EMMC_INT))) {
+      interrupt_masked = true;
+    }
+  }
+
+  mmio_write(emmc_base + EMMC_IRPT_EN, 0);
+  spin_wait_end(&ws, irpts != 0);
+  return mmio_read(emmc_base + EMMC_INTERRUPT);
+}
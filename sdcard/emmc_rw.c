@@ -57,6 +57,11 @@
 #include "emmc_internal.h"
 
 
+#ifdef SD_WRITE_SUPPORT
+static uint32_t sd_erase_timeout(struct emmc_block_dev *edev, uint32_t nblocks);
+#endif
+
+
 /* @brief   Read from an SD card
  *
  */
@@ -96,3 +101,90 @@ int sd_write(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t b
 }
 #endif
 
+
+/* @brief   Erase a range of blocks that no longer hold live data
+ *
+ * @param   dev, the card
+ * @param   block_no, first 512 byte block to erase
+ * @param   nblocks, number of blocks
+ * @return  0 on success, -1 on failure
+ *
+ * Each chunk of up to SD_ERASE_MAX_BLOCKS is erased with
+ * ERASE_WR_BLK_START, ERASE_WR_BLK_END and ERASE. ERASE is an R1b command,
+ * the wait for it to complete also covers the card releasing busy.
+ */
+#ifdef SD_WRITE_SUPPORT
+int sd_discard(struct block_device *dev, uint32_t block_no, uint32_t nblocks)
+{
+  struct emmc_block_dev *edev = (struct emmc_block_dev *)dev;
+  uint32_t chunk;
+  uint32_t start;
+  uint32_t end;
+
+  if (sd_ensure_data_mode(edev) != 0) {
+    return -1;
+  }
+
+  while (nblocks > 0) {
+    chunk = (nblocks < SD_ERASE_MAX_BLOCKS) ? nblocks : SD_ERASE_MAX_BLOCKS;
+
+    // SDSC cards are byte addressed
+    start = block_no;
+    end = block_no + chunk - 1;
+
+    if (!edev->card_supports_sdhc) {
+      start *= 512;
+      end *= 512;
+    }
+
+    sd_issue_command(edev, ERASE_WR_BLK_START, start, 500000);
+    if (FAIL(edev)) {
+      log_error("sd_discard() error sending CMD32");
+      return -1;
+    }
+
+    sd_issue_command(edev, ERASE_WR_BLK_END, end, 500000);
+    if (FAIL(edev)) {
+      log_error("sd_discard() error sending CMD33");
+      return -1;
+    }
+
+    sd_issue_command(edev, ERASE, 0, sd_erase_timeout(edev, chunk));
+    if (FAIL(edev)) {
+      log_error("sd_discard() error sending CMD38");
+      return -1;
+    }
+
+    block_no += chunk;
+    nblocks -= chunk;
+  }
+
+  return 0;
+}
+#endif
+
+
+/* @brief   Get the time to allow for erasing a range of blocks
+ *
+ * @param   edev, the card
+ * @param   nblocks, number of blocks in the range
+ * @return  timeout in microseconds
+ *
+ * Uses the SD Status erase fields if the card provides them, PLSS
+ * 4.10.2.5, otherwise 250ms per block.
+ */
+#ifdef SD_WRITE_SUPPORT
+static uint32_t sd_erase_timeout(struct emmc_block_dev *edev, uint32_t nblocks)
+{
+  uint32_t nau;
+
+  if (edev->au_size == 0 || edev->erase_size == 0 || edev->erase_timeout == 0) {
+    return nblocks * SD_ERASE_TIMEOUT_PER_BLOCK;
+  }
+
+  // A range not aligned to AUs may touch one more AU at each end
+  nau = ((uint64_t)nblocks * 512 + edev->au_size - 1) / edev->au_size + 2;
+
+  return (edev->erase_timeout * nau / edev->erase_size + edev->erase_offset + 1) * 1000000;
+}
+#endif
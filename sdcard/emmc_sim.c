@@ -0,0 +1,929 @@
+/*
+ * Register level model of the SDHCI controller and an SD card.
+ *
+ * Built when EMMC_SIMULATOR is defined, see sdcard.h. mmio_read() and
+ * mmio_write() are then directed here rather than to the hardware and the
+ * card's blocks are held in a disk image file. This allows sd_card_init(),
+ * sd_issue_command_int() and sd_do_data_command() to be run and profiled
+ * without a card, for example to measure the cost of the polling loops
+ * and per command overheads.
+ *
+ * Timing model:
+ *
+ * Each command takes config.model_latency us from writing EMMC_CMDTM to
+ * the command complete interrupt. Each data block then takes the time to
+ * clock it over the bus, at the SD clock programmed in EMMC_CONTROL1 and
+ * the bus width in EMMC_CONTROL0. Writes and R1b commands hold DAT0 busy
+ * for a further config.model_busy us before transfer complete.
+ *
+ * ADMA2 transfers walk the descriptor table at EMMC_ADMA_SYS_ADDR and
+ * copy each descriptor's data between the image and memory when the
+ * command is issued. Transfer complete follows after the time to clock
+ * all blocks over the bus. sd_bus_addr() gives the simulator virtual
+ * addresses as bus addresses, as it accesses the driver's memory directly.
+ *
+ * Limitations:
+ *
+ * No interrupt is raised, init_interrupts() reports the interrupt as
+ * unavailable and the driver polls EMMC_INTERRUPT. ADMA2 descriptors with
+ * the INT attribute do not raise the DMA interrupt.
+ *
+ * The simulator runs within the driver on CheviotOS, it is not built for
+ * other hosts.
+ *
+ * TODO: Host build with a shim for the message calls, see README.md
+ */
+
+#define LOG_LEVEL_WARN
+
+#include "sys/debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscalls.h>
+#include <time.h>
+#include <unistd.h>
+#include "sdcard.h"
+#include "globals.h"
+#include "emmc_internal.h"
+
+#ifdef EMMC_SIMULATOR
+
+// Card states, PLSS 4.3
+#define SIM_STATE_IDLE    0
+#define SIM_STATE_READY   1
+#define SIM_STATE_IDENT   2
+#define SIM_STATE_STBY    3
+#define SIM_STATE_TRAN    4
+#define SIM_STATE_DATA    5
+#define SIM_STATE_RCV     6
+#define SIM_STATE_PRG     7
+
+#define SIM_RCA           0x1234
+#define SIM_MAX_EVENTS    4
+#define SIM_BUF_SZ        512
+
+#define SIM_CAPABILITIES_0  (SD_CAP_ADMA2 | SD_CAP_HIGH_SPEED | ((SD_RPI_BASE_CLOCK / 1000000) << 8))
+#define SIM_VERSION         ((0x99 << 24) | (2 << 16))
+
+// R1 card status bits
+#define SIM_R1_READY      (1 << 8)
+#define SIM_R1_APP_CMD    (1 << 5)
+#define SIM_R1_OUT_OF_RANGE (1U << 31)
+
+// EMMC_ADMA_ERR_STATUS bits, HCSS 2.2.30
+#define SIM_ADMA_ST_FDS   1
+#define SIM_ADMA_ST_TFR   3
+#define SIM_ADMA_LEN_ERR  (1 << 2)
+
+// @brief   Interrupt status bits that become set at a future time
+struct sim_event
+{
+  struct timespec ts;
+  uint32_t irpts;
+};
+
+// @brief   State of the simulated controller and card
+struct sim
+{
+  int fd;
+  block64_t nblocks;
+
+  // Controller registers
+  uint32_t arg1;
+  uint32_t arg2;
+  uint32_t blksizecnt;
+  uint32_t cmdtm;
+  uint32_t resp[4];
+  uint32_t control0;
+  uint32_t control1;
+  uint32_t control2;
+  uint32_t interrupt;
+  uint32_t irpt_mask;
+  uint32_t irpt_en;
+  uint32_t adma_addr;
+  uint32_t adma_err;
+
+  struct sim_event events[SIM_MAX_EVENTS];
+  int nevents;
+  bool cmd_inhibit;
+  bool dat_inhibit;
+
+  // Card
+  int state;
+  bool app_cmd;
+  int bus_width;
+  uint32_t block_count;     // set by CMD23 or Auto-CMD23, 0 if open-ended
+  uint32_t erase_start;     // set by CMD32
+  uint32_t erase_end;       // set by CMD33
+
+  // Data transfer in progress
+  bool xfer_write;
+  bool xfer_active;
+  block64_t xfer_block;
+  uint32_t xfer_blocks;     // blocks remaining, including the current one
+  uint32_t xfer_blksize;
+  uint32_t xfer_pos;        // byte position within the current block
+  bool xfer_from_image;     // data is image blocks rather than a register
+  uint8_t buf[SIM_BUF_SZ];
+};
+
+
+static struct sim sim;
+
+
+static void sim_issue_command(uint32_t cmdtm);
+static void sim_card_command(int index, uint32_t arg, bool is_app);
+static void sim_start_read(block64_t block, uint32_t nblocks, bool from_image);
+static void sim_start_write(block64_t block, uint32_t nblocks);
+static void sim_adma_transfer(block64_t block, uint32_t nblocks, bool is_write);
+static void sim_next_read_block(void);
+static void sim_write_block(void);
+static uint32_t sim_data_read(void);
+static void sim_data_write(uint32_t data);
+static void sim_erase(void);
+static void sim_update(void);
+static void sim_schedule(uint32_t irpts, uint32_t delay_us);
+static uint32_t sim_block_time(uint32_t sz);
+static uint32_t sim_r1(void);
+
+
+/* @brief   Open the image holding the simulated card's blocks
+ *
+ * @param   path, pathname of the disk image
+ * @return  0 on success, negative errno on failure
+ *
+ * emmc_base is set to a non-NULL token, mmio_read() and mmio_write()
+ * subtract it to get the register offset.
+ */
+int emmc_sim_init(char *path)
+{
+  struct stat st;
+
+  memset(&sim, 0, sizeof sim);
+
+  sim.fd = open(path, O_RDWR);
+
+  if (sim.fd < 0) {
+    log_error("cannot open simulator image %s", path);
+    return -errno;
+  }
+
+  if (fstat(sim.fd, &st) != 0) {
+    close(sim.fd);
+    return -EIO;
+  }
+
+  sim.nblocks = st.st_size / 512;
+  sim.bus_width = 1;
+  sim.state = SIM_STATE_IDLE;
+
+  emmc_base = (uintptr_t)EMMC_REGS_START_VADDR;
+  log_info("simulating card, image %s, %u blocks", path, (uint32_t)sim.nblocks);
+  return 0;
+}
+
+
+/* @brief   Read a simulated controller register
+ *
+ * @param   reg, offset of the register
+ * @return  value of the register
+ */
+uint32_t emmc_sim_read(uint32_t reg)
+{
+  uint32_t status;
+
+  sim_update();
+
+  switch (reg) {
+    case EMMC_ARG2:
+      return sim.arg2;
+
+    case EMMC_BLKSIZECNT:
+      return sim.blksizecnt;
+
+    case EMMC_ARG1:
+      return sim.arg1;
+
+    case EMMC_CMDTM:
+      return sim.cmdtm;
+
+    case EMMC_RESP0:
+    case EMMC_RESP1:
+    case EMMC_RESP2:
+    case EMMC_RESP3:
+      return sim.resp[(reg - EMMC_RESP0) / 4];
+
+    case EMMC_DATA:
+      return sim_data_read();
+
+    case EMMC_STATUS:
+      // Card inserted, stable and not write protected, DAT lines high
+      status = (1 << 16) | (1 << 17) | (1 << 18) | (0xf << 20) | (1 << 24);
+
+      if (sim.cmd_inhibit) {
+        status |= 0x1;
+      }
+
+      if (sim.dat_inhibit) {
+        status |= 0x2;
+      }
+
+      return status;
+
+    case EMMC_CONTROL0:
+      return sim.control0;
+
+    case EMMC_CONTROL1:
+      return sim.control1;
+
+    case EMMC_INTERRUPT:
+      return sim.interrupt;
+
+    case EMMC_IRPT_MASK:
+      return sim.irpt_mask;
+
+    case EMMC_IRPT_EN:
+      return sim.irpt_en;
+
+    case EMMC_CONTROL2:
+      return sim.control2;
+
+    case EMMC_ADMA_ERR_STATUS:
+      return sim.adma_err;
+
+    case EMMC_ADMA_SYS_ADDR:
+      return sim.adma_addr;
+
+    case EMMC_CAPABILITIES_0:
+      return SIM_CAPABILITIES_0;
+
+    case EMMC_CAPABILITIES_1:
+      return 0;
+
+    case EMMC_SLOTISR_VER:
+      return SIM_VERSION;
+
+    default:
+      return 0;
+  }
+}
+
+
+/* @brief   Write a simulated controller register
+ *
+ * @param   reg, offset of the register
+ * @param   data, value written
+ */
+void emmc_sim_write(uint32_t reg, uint32_t data)
+{
+  sim_update();
+
+  switch (reg) {
+    case EMMC_ARG2:
+      sim.arg2 = data;
+      break;
+
+    case EMMC_BLKSIZECNT:
+      sim.blksizecnt = data;
+      break;
+
+    case EMMC_ARG1:
+      sim.arg1 = data;
+      break;
+
+    case EMMC_CMDTM:
+      sim.cmdtm = data;
+      sim_issue_command(data);
+      break;
+
+    case EMMC_DATA:
+      sim_data_write(data);
+      break;
+
+    case EMMC_CONTROL0:
+      sim.control0 = data;
+      sim.bus_width = (data & SD_HCTL_DWIDTH_4) ? 4 : 1;
+      break;
+
+    case EMMC_CONTROL1:
+      // Resets complete immediately, the clock is stable once enabled
+      if (data & SD_RESET_ALL) {
+        sim.interrupt = 0;
+        sim.nevents = 0;
+        sim.cmd_inhibit = false;
+        sim.dat_inhibit = false;
+        sim.xfer_active = false;
+        sim.control0 = 0;
+        sim.control2 = 0;
+      } else {
+        if (data & SD_RESET_CMD) {
+          sim.cmd_inhibit = false;
+        }
+
+        if (data & SD_RESET_DAT) {
+          sim.dat_inhibit = false;
+          sim.xfer_active = false;
+          sim.nevents = 0;
+        }
+      }
+
+      data &= ~(SD_RESET_ALL | SD_RESET_CMD | SD_RESET_DAT);
+
+      if (data & 0x1) {
+        data |= 0x2;
+      } else {
+        data &= ~0x2;
+      }
+
+      sim.control1 = data;
+      break;
+
+    case EMMC_INTERRUPT:
+      sim.interrupt &= ~data;
+
+      if ((sim.interrupt & 0xffff0000) == 0) {
+        sim.interrupt &= ~0x8000;
+      }
+      break;
+
+    case EMMC_IRPT_MASK:
+      sim.irpt_mask = data;
+      break;
+
+    case EMMC_IRPT_EN:
+      sim.irpt_en = data;
+      break;
+
+    case EMMC_CONTROL2:
+      sim.control2 = data;
+      break;
+
+    case EMMC_ADMA_SYS_ADDR:
+      sim.adma_addr = data;
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+/* @brief   Start a command written to EMMC_CMDTM
+ *
+ */
+static void sim_issue_command(uint32_t cmdtm)
+{
+  int index = (cmdtm >> 24) & 0x3f;
+  bool is_app = sim.app_cmd;
+
+  sim.app_cmd = false;
+  sim.cmd_inhibit = true;
+
+  if ((cmdtm & SD_CMD_ISDATA) || (cmdtm & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B) {
+    sim.dat_inhibit = true;
+  }
+
+  // Auto-CMD23 sets the block count before the command, HCSS 2.2.6
+  if ((cmdtm & SD_CMD_MULTI_BLOCK) && (cmdtm & SD_CMD_AUTO_CMD_EN_CMD23)) {
+    sim.block_count = sim.arg2;
+  }
+
+  sim_card_command(index, sim.arg1, is_app);
+}
+
+
+/* @brief   Model the card's response to a command
+ *
+ * @param   index, command index
+ * @param   arg, command argument
+ * @param   is_app, true if the previous command was APP_CMD
+ */
+static void sim_card_command(int index, uint32_t arg, bool is_app)
+{
+  uint32_t latency = config.model_latency;
+  uint32_t blksize = sim.blksizecnt & 0x3ff;
+  uint32_t nblocks;
+
+  memset(sim.resp, 0, sizeof sim.resp);
+
+  if (is_app) {
+    switch (index) {
+      case 6:       // SET_BUS_WIDTH
+        sim.resp[0] = sim_r1() | SIM_R1_APP_CMD;
+        sim_schedule(SD_COMMAND_COMPLETE, latency);
+        return;
+
+      case 41:      // SD_SEND_OP_COND, report ready and SDHC once asked
+        sim.resp[0] = (arg == 0) ? 0x00ff8000 : 0xc0ff8000;
+
+        if (arg != 0) {
+          sim.state = SIM_STATE_READY;
+        }
+        sim_schedule(SD_COMMAND_COMPLETE, latency);
+        return;
+
+      case 13:      // SD_STATUS, 4MB AU, class 10, U1, 1 AU erased in 1s
+        memset(sim.buf, 0, SD_STATUS_SZ);
+        sim.buf[0] = (sim.bus_width == 4) ? 0x80 : 0x00;
+        sim.buf[8] = 4;
+        sim.buf[10] = 0x90;
+        sim.buf[12] = 1;
+        sim.buf[13] = (1 << 2) | 1;
+        sim.buf[14] = 0x10;
+        sim.resp[0] = sim_r1() | SIM_R1_APP_CMD;
+        sim_schedule(SD_COMMAND_COMPLETE, latency);
+        sim_start_read(0, 1, false);
+        return;
+
+      case 51:      // SEND_SCR, SD 3.0, 1 and 4-bit, CMD23 supported
+        memset(sim.buf, 0, 8);
+        sim.buf[0] = 0x02;
+        sim.buf[1] = 0x05;
+        sim.buf[2] = 0x80;
+        sim.buf[3] = 0x02;
+        sim.resp[0] = sim_r1() | SIM_R1_APP_CMD;
+        sim_schedule(SD_COMMAND_COMPLETE, latency);
+        sim_start_read(0, 1, false);
+        return;
+
+      default:
+        break;
+    }
+  }
+
+  switch (index) {
+    case GO_IDLE_STATE:
+      sim.state = SIM_STATE_IDLE;
+      sim.bus_width = 1;
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case ALL_SEND_CID:
+      sim.resp[0] = 0x01234567;
+      sim.resp[1] = 0x89abcdef;
+      sim.resp[2] = 0x53494d55;     // "SIMU"
+      sim.resp[3] = 0x00534443;
+      sim.state = SIM_STATE_IDENT;
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case SEND_RELATIVE_ADDR:
+      sim.resp[0] = (SIM_RCA << 16) | (sim.state << 9) | SIM_R1_READY;
+      sim.state = SIM_STATE_STBY;
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case SWITCH_FUNC:       // High speed supported, others not
+      memset(sim.buf, 0, 64);
+      sim.buf[12] = 0x80;
+      sim.buf[13] = 0x03;
+
+      if ((arg & 0xf) == SD_SWITCH_NO_CHANGE || (arg & 0xf) <= SD_BUS_MODE_HIGH) {
+        sim.buf[16] = (arg & 0xf) == SD_SWITCH_NO_CHANGE ? 0 : (arg & 0xf);
+      } else {
+        sim.buf[16] = 0xf;
+      }
+
+      sim.resp[0] = sim_r1();
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      sim_start_read(0, 1, false);
+      break;
+
+    case SELECT_CARD:
+      sim.resp[0] = sim_r1();
+      sim.state = ((arg >> 16) == SIM_RCA) ? SIM_STATE_TRAN : SIM_STATE_STBY;
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      sim_schedule(SD_TRANSFER_COMPLETE, latency + config.model_busy);
+      break;
+
+    case SEND_IF_COND:
+      sim.resp[0] = arg & 0xfff;
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case STOP_TRANSMISSION:
+      sim.resp[0] = sim_r1();
+      sim.xfer_active = false;
+      sim.state = SIM_STATE_TRAN;
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      sim_schedule(SD_TRANSFER_COMPLETE, latency + config.model_busy);
+      break;
+
+    case SEND_STATUS:
+    case SET_BLOCKLEN:
+    case APP_CMD:
+      sim.resp[0] = sim_r1();
+
+      if (index == APP_CMD) {
+        sim.resp[0] |= SIM_R1_APP_CMD;
+        sim.app_cmd = true;
+      }
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case SET_BLOCK_COUNT:
+      sim.block_count = arg & 0xffff;
+      sim.resp[0] = sim_r1();
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case ERASE_WR_BLK_START:
+    case ERASE_WR_BLK_END:
+      if (index == ERASE_WR_BLK_START) {
+        sim.erase_start = arg;
+      } else {
+        sim.erase_end = arg;
+      }
+
+      sim.resp[0] = sim_r1();
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      break;
+
+    case ERASE:
+      sim.resp[0] = sim_r1();
+      sim_erase();
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+      sim_schedule(SD_TRANSFER_COMPLETE, latency + config.model_busy);
+      break;
+
+    case READ_SINGLE_BLOCK:
+    case READ_MULTIPLE_BLOCK:
+    case WRITE_BLOCK:
+    case WRITE_MULTIPLE_BLOCK:
+      nblocks = (index == READ_SINGLE_BLOCK || index == WRITE_BLOCK) ? 1 : (sim.blksizecnt >> 16);
+
+      if (blksize != 512 || arg + nblocks > sim.nblocks) {
+        sim.resp[0] = sim_r1() | SIM_R1_OUT_OF_RANGE;
+        sim_schedule(SD_COMMAND_COMPLETE, latency);
+        sim_schedule(0x8000 | SD_ERR_MASK_DATA_TIMEOUT, latency);
+        break;
+      }
+
+      sim.resp[0] = sim_r1();
+      sim_schedule(SD_COMMAND_COMPLETE, latency);
+
+      if ((sim.cmdtm & SD_CMD_DMA)
+          && (sim.control0 & SD_HCTL_DMA_MASK) == SD_HCTL_DMA_ADMA2) {
+        sim_adma_transfer(arg, nblocks, index == WRITE_BLOCK || index == WRITE_MULTIPLE_BLOCK);
+      } else if (index == READ_SINGLE_BLOCK || index == READ_MULTIPLE_BLOCK) {
+        sim_start_read(arg, nblocks, true);
+      } else {
+        sim_start_write(arg, nblocks);
+      }
+      break;
+
+    default:
+      // No response, as for an unsupported command
+      sim_schedule(0x8000 | SD_ERR_MASK_CMD_TIMEOUT, latency);
+      break;
+  }
+}
+
+
+/* @brief   Begin a read transfer, from the image or from sim.buf
+ *
+ */
+static void sim_start_read(block64_t block, uint32_t nblocks, bool from_image)
+{
+  sim.xfer_write = false;
+  sim.xfer_active = true;
+  sim.xfer_block = block;
+  sim.xfer_blocks = nblocks;
+  sim.xfer_blksize = sim.blksizecnt & 0x3ff;
+  sim.xfer_from_image = from_image;
+  sim.state = SIM_STATE_DATA;
+
+  sim_next_read_block();
+}
+
+
+/* @brief   Load the next block and schedule buffer read ready
+ *
+ */
+static void sim_next_read_block(void)
+{
+  sim.xfer_pos = 0;
+
+  if (sim.xfer_from_image) {
+    if (lseek64(sim.fd, (off64_t)sim.xfer_block * 512, SEEK_SET) < 0
+        || read(sim.fd, sim.buf, 512) != 512) {
+      sim_schedule(0x8000 | SD_ERR_MASK_DATA_CRC, config.model_latency);
+      sim.xfer_active = false;
+      return;
+    }
+  }
+
+  sim_schedule(SD_BUFFER_READ_READY, config.model_latency + sim_block_time(sim.xfer_blksize));
+}
+
+
+/* @brief   Begin a write transfer to the image
+ *
+ */
+static void sim_start_write(block64_t block, uint32_t nblocks)
+{
+  sim.xfer_write = true;
+  sim.xfer_active = true;
+  sim.xfer_block = block;
+  sim.xfer_blocks = nblocks;
+  sim.xfer_blksize = 512;
+  sim.xfer_pos = 0;
+  sim.xfer_from_image = true;
+  sim.state = SIM_STATE_RCV;
+
+  sim_schedule(SD_BUFFER_WRITE_READY, config.model_latency);
+}
+
+
+/* @brief   Transfer the blocks of a data command by walking the ADMA2 table
+ *
+ * @param   block, first block of the image
+ * @param   nblocks, number of blocks to transfer
+ * @param   is_write, true to copy from memory to the image
+ *
+ * An invalid descriptor, a table that ends before all blocks have been
+ * transferred or a failed image access raises an ADMA error. Data beyond
+ * the last block is not transferred, as the controller stops once the
+ * block count is reached.
+ */
+static void sim_adma_transfer(block64_t block, uint32_t nblocks, bool is_write)
+{
+  struct adma2_desc *desc;
+  uint32_t remaining;
+  uint32_t len;
+  uint8_t *addr;
+  ssize_t sc;
+  size_t n;
+
+  sim.xfer_active = false;
+  sim.adma_err = 0;
+  remaining = nblocks * 512;
+  desc = (struct adma2_desc *)(uintptr_t)sim.adma_addr;
+
+  if (lseek64(sim.fd, (off64_t)block * 512, SEEK_SET) < 0) {
+    sim.adma_err = SIM_ADMA_ST_TFR;
+    sim_schedule(0x8000 | SD_ERR_MASK_ADMA, config.model_latency);
+    return;
+  }
+
+  for (n = 0; remaining > 0 && n < ADMA2_MAX_DESC; n++) {
+    if (desc == NULL || (desc->attr & ADMA2_VALID) == 0) {
+      sim.adma_err = SIM_ADMA_ST_FDS;
+      break;
+    }
+
+    if ((desc->attr & ADMA2_ACT_LINK) == ADMA2_ACT_LINK) {
+      desc = (struct adma2_desc *)(uintptr_t)desc->addr;
+      continue;
+    }
+
+    if ((desc->attr & ADMA2_ACT_LINK) == ADMA2_ACT_TRAN) {
+      len = (desc->len == 0) ? ADMA2_MAX_LEN : desc->len;
+      len = MIN(len, remaining);
+      addr = (uint8_t *)(uintptr_t)desc->addr;
+
+      while (len > 0) {
+        sc = is_write ? write(sim.fd, addr, len) : read(sim.fd, addr, len);
+
+        if (sc <= 0) {
+          sim.adma_err = SIM_ADMA_ST_TFR;
+          break;
+        }
+
+        addr += sc;
+        len -= sc;
+        remaining -= sc;
+      }
+
+      if (sim.adma_err != 0) {
+        break;
+      }
+    }
+
+    if (desc->attr & ADMA2_END) {
+      break;
+    }
+
+    desc++;
+  }
+
+  if (sim.adma_err == 0 && remaining > 0) {
+    sim.adma_err = SIM_ADMA_LEN_ERR | SIM_ADMA_ST_TFR;
+  }
+
+  if (sim.adma_err != 0) {
+    sim_schedule(0x8000 | SD_ERR_MASK_ADMA, config.model_latency);
+    return;
+  }
+
+  sim.state = SIM_STATE_TRAN;
+  sim.block_count = 0;
+  sim_schedule(SD_TRANSFER_COMPLETE, config.model_latency + nblocks * sim_block_time(512)
+               + (is_write ? config.model_busy : 0));
+}
+
+
+/*
+ *
+ */
+static uint32_t sim_data_read(void)
+{
+  uint32_t data;
+
+  if (!sim.xfer_active || sim.xfer_write || sim.xfer_pos >= sim.xfer_blksize) {
+    return 0;
+  }
+
+  data = sim.buf[sim.xfer_pos] | (sim.buf[sim.xfer_pos + 1] << 8)
+         | (sim.buf[sim.xfer_pos + 2] << 16) | (sim.buf[sim.xfer_pos + 3] << 24);
+  sim.xfer_pos += 4;
+
+  if (sim.xfer_pos < sim.xfer_blksize) {
+    return data;
+  }
+
+  sim.xfer_blocks--;
+  sim.xfer_block++;
+
+  if (sim.xfer_blocks > 0) {
+    sim_next_read_block();
+  } else {
+    sim.xfer_active = false;
+    sim.state = SIM_STATE_TRAN;
+    sim.block_count = 0;
+    sim_schedule(SD_TRANSFER_COMPLETE, 0);
+  }
+
+  return data;
+}
+
+
+/*
+ *
+ */
+static void sim_data_write(uint32_t data)
+{
+  if (!sim.xfer_active || !sim.xfer_write || sim.xfer_pos >= sim.xfer_blksize) {
+    return;
+  }
+
+  sim.buf[sim.xfer_pos] = data;
+  sim.buf[sim.xfer_pos + 1] = data >> 8;
+  sim.buf[sim.xfer_pos + 2] = data >> 16;
+  sim.buf[sim.xfer_pos + 3] = data >> 24;
+  sim.xfer_pos += 4;
+
+  if (sim.xfer_pos >= sim.xfer_blksize) {
+    sim_write_block();
+  }
+}
+
+
+/* @brief   Commit a completely received block to the image
+ *
+ */
+static void sim_write_block(void)
+{
+  uint32_t block_time = sim_block_time(sim.xfer_blksize);
+
+  if (lseek64(sim.fd, (off64_t)sim.xfer_block * 512, SEEK_SET) < 0
+      || write(sim.fd, sim.buf, 512) != 512) {
+    sim_schedule(0x8000 | SD_ERR_MASK_DATA_CRC, block_time);
+    sim.xfer_active = false;
+    return;
+  }
+
+  sim.xfer_pos = 0;
+  sim.xfer_blocks--;
+  sim.xfer_block++;
+
+  if (sim.xfer_blocks > 0) {
+    sim_schedule(SD_BUFFER_WRITE_READY, block_time);
+  } else {
+    sim.xfer_active = false;
+    sim.state = SIM_STATE_TRAN;
+    sim.block_count = 0;
+    sim_schedule(SD_TRANSFER_COMPLETE, block_time + config.model_busy);
+  }
+}
+
+
+/* @brief   Zero the blocks from erase_start to erase_end in the image
+ *
+ */
+static void sim_erase(void)
+{
+  uint8_t zero[512];
+
+  memset(zero, 0, sizeof zero);
+
+  for (block64_t b = sim.erase_start; b <= sim.erase_end && b < sim.nblocks; b++) {
+    if (lseek64(sim.fd, (off64_t)b * 512, SEEK_SET) < 0 || write(sim.fd, zero, 512) != 512) {
+      log_error("simulator erase failed, block:%u", (uint32_t)b);
+      return;
+    }
+  }
+}
+
+
+/* @brief   Move interrupt status bits whose time has come into EMMC_INTERRUPT
+ *
+ */
+static void sim_update(void)
+{
+  struct timespec now;
+  struct timespec diff;
+  int t;
+
+  if (sim.nevents == 0) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  t = 0;
+  while (t < sim.nevents) {
+    if (diff_timespec(&diff, &now, &sim.events[t].ts)) {
+      sim.interrupt |= sim.events[t].irpts;
+
+      if (sim.events[t].irpts & 0xffff0000) {
+        sim.interrupt |= 0x8000;
+        sim.cmd_inhibit = false;
+        sim.dat_inhibit = false;
+      }
+
+      if (sim.events[t].irpts & SD_COMMAND_COMPLETE) {
+        sim.cmd_inhibit = false;
+      }
+
+      if (sim.events[t].irpts & SD_TRANSFER_COMPLETE) {
+        sim.dat_inhibit = false;
+      }
+
+      sim.events[t] = sim.events[--sim.nevents];
+    } else {
+      t++;
+    }
+  }
+}
+
+
+/* @brief   Set interrupt status bits after a delay
+ *
+ * @param   irpts, EMMC_INTERRUPT bits to set
+ * @param   delay_us, delay from now in microseconds
+ */
+static void sim_schedule(uint32_t irpts, uint32_t delay_us)
+{
+  struct timespec now;
+  struct timespec delay;
+
+  if (sim.nevents == SIM_MAX_EVENTS) {
+    log_error("simulator event list full");
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  delay.tv_sec = delay_us / 1000000;
+  delay.tv_nsec = (delay_us % 1000000) * 1000;
+
+  add_timespec(&sim.events[sim.nevents].ts, &now, &delay);
+  sim.events[sim.nevents].irpts = irpts;
+  sim.nevents++;
+}
+
+
+/* @brief   Time to clock a block over the data bus, in microseconds
+ *
+ * The SD clock is the base clock divided by twice the 10-bit divider in
+ * EMMC_CONTROL1, HCSS 2.2.14.
+ */
+static uint32_t sim_block_time(uint32_t sz)
+{
+  uint32_t divider;
+  uint32_t clock;
+
+  divider = ((sim.control1 >> 8) & 0xff) | (((sim.control1 >> 6) & 0x3) << 8);
+  clock = (divider == 0) ? SD_RPI_BASE_CLOCK : SD_RPI_BASE_CLOCK / (2 * divider);
+
+  return ((uint64_t)sz * 8 * 1000000) / ((uint64_t)clock * sim.bus_width);
+}
+
+
+/*
+ *
+ */
+static uint32_t sim_r1(void)
+{
+  return (sim.state << 9) | SIM_R1_READY;
+}
+
+#endif
@@ -0,0 +1,488 @@
+/*
+ * Bus width and bus speed mode negotiation, ACMD6 SET_BUS_WIDTH,
+ * CMD6 SWITCH_FUNC and CMD19 tuning. Card performance parameters from
+ * the ACMD13 SD Status.
+ *
+ * References:
+ *
+ * PLSS 	- SD Group Physical Layer Simplified Specification ver 3.00
+ * HCSS		- SD Group Host Controller Simplified Specification ver 3.00
+ */
+
+//#define NDEBUG
+//#define EMMC_DEBUG
+#define LOG_LEVEL_WARN
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/debug.h>
+#include <sys/syscalls.h>
+#include <machine/cheviot_hal.h>
+#include "timer.h"
+#include "util.h"
+#include "sdcard.h"
+#include "mmio.h"
+#include "globals.h"
+#include "emmc_internal.h"
+
+
+static int sd_set_card_bus_width(struct emmc_block_dev *dev, int width);
+static int sd_verify_bus_width(struct emmc_block_dev *dev);
+static int sd_switch_func(struct emmc_block_dev *dev, uint32_t arg, uint8_t *status);
+static int sd_try_bus_mode(struct emmc_block_dev *dev, int mode);
+static void sd_set_host_bus_mode(int mode);
+static int sd_execute_tuning(struct emmc_block_dev *dev);
+
+
+// Clock rate of each bus mode, indexed by SD_BUS_MODE_*
+static const uint32_t sd_bus_mode_clock[] = {
+  SD_CLOCK_NORMAL, SD_CLOCK_HIGH, SD_CLOCK_SDR50, SD_CLOCK_SDR104
+};
+
+
+/* @brief   Switch the card and host to the 4-bit data bus
+ *
+ * @param   dev, the card, in the transfer state with the SCR read
+ * @return  0 on success, -1 if the card was left in 1-bit mode
+ *
+ * Follows HCSS 3.4. After switching, the SCR is read again over the 4-bit
+ * bus and compared with the copy read in 1-bit mode. If the switch or the
+ * comparison fails the card and host are returned to 1-bit mode. The
+ * width in use is recorded in dev->bus_width.
+ */
+int sd_set_bus_width(struct emmc_block_dev *dev)
+{
+  uint32_t irpt_mask;
+  int sc;
+
+  dev->bus_width = 1;
+
+  if ((dev->scr->sd_bus_widths & SD_SCR_BUS_WIDTH_4) == 0) {
+    log_info("card does not support 4-bit data bus");
+    return -1;
+  }
+
+  // Disable card interrupt in host whilst changing width
+  irpt_mask = mmio_read(emmc_base + EMMC_IRPT_MASK);
+  mmio_write(emmc_base + EMMC_IRPT_MASK, irpt_mask & ~SD_CARD_INTERRUPT);
+
+  sc = sd_set_card_bus_width(dev, 4);
+
+  if (sc == 0) {
+    sc = sd_verify_bus_width(dev);
+
+    if (sc != 0) {
+      log_warn("4-bit data bus verification failed, using 1-bit");
+      sd_set_card_bus_width(dev, 1);
+    }
+  } else {
+    log_warn("switch to 4-bit data mode failed");
+  }
+
+  mmio_write(emmc_base + EMMC_IRPT_MASK, irpt_mask);
+
+  if (sc == 0) {
+    dev->bus_width = 4;
+  }
+
+  return sc;
+}
+
+
+/* @brief   Set the data bus width of the card with ACMD6 and then the host
+ *
+ * @param   dev, the card
+ * @param   width, 1 or 4
+ * @return  0 on success, -1 if the card rejected the command
+ */
+static int sd_set_card_bus_width(struct emmc_block_dev *dev, int width)
+{
+  uint32_t control0;
+
+  sd_issue_command(dev, SET_BUS_WIDTH, (width == 4) ? 0x2 : 0x0, 500000);
+
+  if (FAIL(dev)) {
+    return -1;
+  }
+
+  control0 = mmio_read(emmc_base + EMMC_CONTROL0);
+
+  if (width == 4) {
+    control0 |= SD_HCTL_DWIDTH_4;
+  } else {
+    control0 &= ~SD_HCTL_DWIDTH_4;
+  }
+
+  mmio_write(emmc_base + EMMC_CONTROL0, control0);
+  return 0;
+}
+
+
+/* @brief   Check data is read correctly over the current bus width
+ *
+ * @param   dev, the card, with dev->scr read in 1-bit mode
+ * @return  0 if the SCR reads back unchanged, -1 otherwise
+ */
+static int sd_verify_bus_width(struct emmc_block_dev *dev)
+{
+  uint32_t scr[2];
+
+  scr[0] = ~dev->scr->scr[0];
+  scr[1] = ~dev->scr->scr[1];
+
+  dev->buf = &scr[0];
+  dev->block_size = 8;
+  dev->blocks_to_transfer = 1;
+  sd_issue_command(dev, SEND_SCR, 0, 500000);
+  dev->block_size = 512;
+
+  if (FAIL(dev)) {
+    sd_reset_cmd();
+    sd_reset_dat();
+    return -1;
+  }
+
+  if (scr[0] != dev->scr->scr[0] || scr[1] != dev->scr->scr[1]) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Switch the card and host to the fastest common bus speed mode
+ *
+ * @param   dev, the card, in the transfer state at the default speed
+ * @return  0 on success, including staying at the default speed
+ *
+ * CMD6 in check mode returns the access modes of function group 1 the card
+ * supports. The fastest mode also supported by the host is tried first,
+ * SDR50 and SDR104 only if the card was switched to 1.8V signalling.
+ * If the switch, or the tuning required by the UHS-I modes, fails the
+ * next slower mode is tried, down to the default speed.
+ */
+int sd_set_bus_speed(struct emmc_block_dev *dev)
+{
+  uint8_t status[64] __attribute__((aligned(4)));
+  uint32_t card_modes;
+  uint32_t host_modes;
+
+  dev->bus_mode = SD_BUS_MODE_DEFAULT;
+
+  if (dev->scr->sd_version < SD_VER_1_1) {
+    return 0;
+  }
+
+  if (sd_switch_func(dev, SD_SWITCH_CHECK | SD_SWITCH_GROUP1(SD_SWITCH_NO_CHANGE), status) != 0) {
+    log_warn("CMD6 check failed, staying at default speed");
+    return 0;
+  }
+
+  // Bits 415:400 of the switch status are the group 1 support bits
+  card_modes = (status[12] << 8) | status[13];
+  dev->card_bus_modes = card_modes;
+
+  host_modes = 0;
+
+  if (capabilities_0 & SD_CAP_HIGH_SPEED) {
+    host_modes |= (1 << SD_BUS_MODE_HIGH);
+  }
+
+  if (dev->uhs_signalling) {
+    if (capabilities_1 & SD_CAP1_SDR50) {
+      host_modes |= (1 << SD_BUS_MODE_SDR50);
+    }
+
+    if (capabilities_1 & SD_CAP1_SDR104) {
+      host_modes |= (1 << SD_BUS_MODE_SDR104);
+    }
+  }
+
+  log_info("bus modes, card: %04x, host: %04x", card_modes, host_modes);
+
+  if ((card_modes & host_modes) == 0) {
+    return 0;
+  }
+
+  for (int mode = SD_BUS_MODE_SDR104; mode > SD_BUS_MODE_DEFAULT; mode--) {
+    if ((card_modes & host_modes & (1 << mode)) == 0) {
+      continue;
+    }
+
+    if (sd_try_bus_mode(dev, mode) == 0) {
+      dev->bus_mode = mode;
+      log_info("bus mode %s", sd_bus_modes[mode]);
+      return 0;
+    }
+
+    log_warn("bus mode %s failed", sd_bus_modes[mode]);
+  }
+
+  // Return card and host to the default speed after any failed attempt
+  sd_switch_func(dev, SD_SWITCH_SET | SD_SWITCH_GROUP1(SD_BUS_MODE_DEFAULT), status);
+  sd_set_host_bus_mode(SD_BUS_MODE_DEFAULT);
+  sd_switch_clock_rate(dev->base_clock, SD_CLOCK_NORMAL);
+  return 0;
+}
+
+
+/* @brief   Halve the SD clock after repeated transfer errors
+ *
+ * @param   dev, the card
+ * @return  0 on success, -1 if already at SD_RECOVER_MIN_CLOCK
+ *
+ * The card stays in its bus speed mode, a card accepts any clock up to the
+ * maximum of the mode. The clock is restored by sd_restore_clock() once
+ * SD_RECOVER_RESTORE_AFTER data commands have succeeded in a row, or when
+ * the card is re-initialised.
+ */
+int sd_step_down_clock(struct emmc_block_dev *dev)
+{
+  uint32_t rate;
+
+  rate = sd_bus_mode_clock[dev->bus_mode] >> (dev->clock_step + 1);
+
+  if (rate < SD_RECOVER_MIN_CLOCK) {
+    return -1;
+  }
+
+  if (sd_switch_clock_rate(dev->base_clock, rate) != 0) {
+    return -1;
+  }
+
+  dev->clock_step++;
+  dev->clock_ok_count = 0;
+  log_warn("clock stepped down to %u Hz", rate);
+  return 0;
+}
+
+
+/* @brief   Restore the clock of the bus speed mode after a step down
+ *
+ * @param   dev, the card
+ * @return  0 on success, -1 on failure
+ */
+int sd_restore_clock(struct emmc_block_dev *dev)
+{
+  uint32_t rate;
+
+  rate = sd_bus_mode_clock[dev->bus_mode];
+
+  if (sd_switch_clock_rate(dev->base_clock, rate) != 0) {
+    return -1;
+  }
+
+  dev->clock_step = 0;
+  dev->clock_ok_count = 0;
+  sd_recover_stats[SD_RECOVER_CLOCK].restored++;
+  log_info("clock restored to %u Hz", rate);
+  return 0;
+}
+
+
+/* @brief   Switch the card and host to a bus speed mode
+ *
+ * @param   dev, the card
+ * @param   mode, one of SD_BUS_MODE_*
+ * @return  0 on success, -1 on failure with the host at the default speed
+ */
+static int sd_try_bus_mode(struct emmc_block_dev *dev, int mode)
+{
+  uint8_t status[64] __attribute__((aligned(4)));
+
+  if (sd_switch_func(dev, SD_SWITCH_SET | SD_SWITCH_GROUP1(mode), status) != 0) {
+    return -1;
+  }
+
+  // Bits 379:376 of the switch status are the selected group 1 function
+  if ((status[16] & 0x0f) != mode) {
+    return -1;
+  }
+
+  // The card switches within 8 clocks of the end of the status block
+  delay_microsecs(10);
+
+  sd_set_host_bus_mode(mode);
+
+  if (sd_switch_clock_rate(dev->base_clock, sd_bus_mode_clock[mode]) != 0) {
+    sd_set_host_bus_mode(SD_BUS_MODE_DEFAULT);
+    return -1;
+  }
+
+  if (mode == SD_BUS_MODE_SDR104
+      || (mode == SD_BUS_MODE_SDR50 && (capabilities_1 & SD_CAP1_SDR50_TUNING))) {
+    if (sd_execute_tuning(dev) != 0) {
+      sd_set_host_bus_mode(SD_BUS_MODE_DEFAULT);
+      sd_switch_clock_rate(dev->base_clock, SD_CLOCK_NORMAL);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* @brief   Issue CMD6 SWITCH_FUNC and read the 512 bit switch status
+ *
+ * @param   dev, the card
+ * @param   arg, the CMD6 argument, mode and function of each group
+ * @param   status, 64 byte buffer for the big-endian switch status
+ * @return  0 on success, -1 on failure
+ */
+static int sd_switch_func(struct emmc_block_dev *dev, uint32_t arg, uint8_t *status)
+{
+  dev->buf = status;
+  dev->block_size = 64;
+  dev->blocks_to_transfer = 1;
+  sd_issue_command(dev, SWITCH_FUNC, arg, 500000);
+  dev->block_size = 512;
+
+  if (FAIL(dev)) {
+    log_warn("error sending SWITCH_FUNC %08x", arg);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Program the host controller for a bus speed mode
+ *
+ * High speed uses the High Speed Enable bit of Host Control 1, the UHS-I
+ * modes use the UHS Mode Select field of Host Control 2, HCSS 2.2.11 and
+ * 2.2.39.
+ */
+static void sd_set_host_bus_mode(int mode)
+{
+  uint32_t control0;
+  uint32_t control2;
+
+  control0 = mmio_read(emmc_base + EMMC_CONTROL0);
+  control2 = mmio_read(emmc_base + EMMC_CONTROL2);
+
+  control0 &= ~SD_HCTL_HS_EN;
+  control2 &= ~(SD_CTRL2_UHS_MASK | SD_CTRL2_EXEC_TUNING | SD_CTRL2_SAMPLE_CLK);
+
+  switch (mode) {
+    case SD_BUS_MODE_HIGH:
+      control0 |= SD_HCTL_HS_EN;
+      break;
+
+    case SD_BUS_MODE_SDR50:
+      control2 |= SD_CTRL2_UHS_SDR50;
+      break;
+
+    case SD_BUS_MODE_SDR104:
+      control2 |= SD_CTRL2_UHS_SDR104;
+      break;
+
+    default:
+      break;
+  }
+
+  mmio_write(emmc_base + EMMC_CONTROL0, control0);
+  mmio_write(emmc_base + EMMC_CONTROL2, control2);
+}
+
+
+/* @brief   Tune the sampling clock with CMD19 SEND_TUNING_BLOCK
+ *
+ * @param   dev, the card
+ * @return  0 if the host selected a tuned sampling clock, -1 otherwise
+ *
+ * Follows HCSS 3.7. The host consumes each tuning block itself, only the
+ * Buffer Read Ready interrupt is waited for, so the command is issued
+ * directly rather than through sd_issue_command().
+ */
+static int sd_execute_tuning(struct emmc_block_dev *dev)
+{
+  uint32_t control2;
+  uint32_t irpts;
+
+  control2 = mmio_read(emmc_base + EMMC_CONTROL2);
+  control2 |= SD_CTRL2_EXEC_TUNING;
+  mmio_write(emmc_base + EMMC_CONTROL2, control2);
+
+  for (int t = 0; t < SD_TUNING_MAX_LOOPS; t++) {
+    mmio_write(emmc_base + EMMC_BLKSIZECNT, 64 | (1 << 16));
+    mmio_write(emmc_base + EMMC_ARG1, 0);
+    mmio_write(emmc_base + EMMC_CMDTM, sd_commands[SEND_TUNING_BLOCK]);
+
+    irpts = sd_wait_interrupt(SD_BUFFER_READ_READY | 0x8000, 150000);
+    mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0000 | SD_BUFFER_READ_READY | SD_COMMAND_COMPLETE);
+
+    if (irpts & 0xffff0000) {
+      log_warn("tuning block error: %08x", irpts);
+      sd_reset_cmd();
+      sd_reset_dat();
+    }
+
+    control2 = mmio_read(emmc_base + EMMC_CONTROL2);
+
+    if ((control2 & SD_CTRL2_EXEC_TUNING) == 0) {
+      break;
+    }
+  }
+
+  mmio_write(emmc_base + EMMC_BLKSIZECNT, dev->block_size);
+
+  if ((control2 & SD_CTRL2_EXEC_TUNING) || (control2 & SD_CTRL2_SAMPLE_CLK) == 0) {
+    log_warn("tuning failed, control2: %08x", control2);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Read the SD Status to get the allocation unit size and speed class
+ *
+ * @param   dev, the card, in the transfer state
+ * @return  0 on success, -1 if the SD Status could not be read
+ *
+ * The SD Status is a 512 bit big-endian structure, PLSS Table 4-44. The
+ * allocation unit is the unit the card's flash translation layer manages,
+ * writes that stay within an AU avoid the card moving data between AUs.
+ * On failure the fields are left zero and writes are not AU aligned.
+ */
+int sd_read_sd_status(struct emmc_block_dev *dev)
+{
+  uint8_t status[SD_STATUS_SZ];
+  uint32_t au_size;
+  int speed_class;
+
+  dev->buf = status;
+  dev->block_size = SD_STATUS_SZ;
+  dev->blocks_to_transfer = 1;
+  sd_issue_command(dev, SD_STATUS, 0, 500000);
+  dev->block_size = 512;
+
+  if (FAIL(dev)) {
+    log_warn("error sending SD_STATUS");
+    return -1;
+  }
+
+  speed_class = status[8];
+  au_size = sd_au_sizes[status[10] >> 4] * 1024;
+
+  dev->speed_class = (speed_class < 5) ? sd_speed_classes[speed_class] : 0;
+  dev->erase_size = (status[11] << 8) | status[12];
+  dev->erase_timeout = status[13] >> 2;
+  dev->erase_offset = status[13] & 0x3;
+  dev->uhs_speed_grade = status[14] >> 4;
+
+  // UHS_AU_SIZE applies to UHS-I cards, AU_SIZE is limited to 4MB for SDHC
+  if ((status[14] & 0xf) != 0) {
+    au_size = sd_au_sizes[status[14] & 0xf] * 1024;
+  }
+
+  dev->au_size = au_size;
+
+  log_info("SD Status: AU %u KB, speed class %d, UHS grade %d",
+           au_size / 1024, dev->speed_class, dev->uhs_speed_grade);
+  return 0;
+}
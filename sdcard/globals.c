@@ -20,16 +20,32 @@ struct block_device actual_device;
 struct block_device *bdev;
 
 uint8_t bootsector[512];        // buffer to read bootsector into
-uint8_t *buf;
-uint8_t *buf_phys;
 
-bool buf_valid = false;
-off64_t buf_start_block_no = 0;
+struct block_cache cache;       // block cache shared by all units
+uint8_t *xfer_buf;              // staging buffer for multi-block transfers
+
+struct io_queue ioq;            // reads and writes waiting to be sorted
 
 int kq;                         // kqueue handle
+int irq_kq = -1;                // kqueue to wait on for EMMC interrupts
+
+int emmc_irq = -1;              // EMMC interrupt number from device tree
+int isrid = -1;                 // interrupt server handle
+bool interrupt_masked = true;   // true whilst the EMMC interrupt is masked
 
 struct Config config;
 
+struct init_phase init_phases[INIT_PHASES_MAX];  // time taken by each phase of init()
+int ninit_phases;
+bool init_done;                 // init() complete, later re-initialization is not timed
+
+struct hot_list hot_record;     // blocks read since start, saved by save_hot_list()
+struct hot_list hot_prefetch;   // blocks read during the previous boot
+uint32_t hot_prefetch_next;     // next extent of hot_prefetch to read
+uint32_t hot_prefetch_chunks;   // chunks of hot_prefetch read so far
+struct timespec hot_record_ts;  // time recording started
+bool hot_recording;
+
 int nunits;                     // number of discovered units and partitions.
 struct bdev_unit unit[5];      // Maximum 5 units, e.g. sda, sda1, sda2, sda3 and sda5
 
@@ -43,6 +59,17 @@ profiling_define_ts(read, 128);
 profiling_define_ts(write, 128);
 profiling_define_counter(read);
 profiling_define_counter(write);
+profiling_define_counter(cache_hit);
+profiling_define_counter(cache_miss);
+profiling_define_counter(cache_evict);
+profiling_define_counter(readahead);
+profiling_define_counter(direct_read);
+profiling_define_counter(writeback);
+profiling_define_counter(ioq_merge);
+profiling_define_counter(discard);
+
+struct latency_histogram read_latency[LATENCY_SIZE_CLASSES];
+struct latency_histogram write_latency[LATENCY_SIZE_CLASSES];
 
 bool shutdown;
 
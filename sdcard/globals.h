@@ -23,16 +23,32 @@ extern struct block_device actual_device;
 extern struct block_device *bdev;
 
 extern uint8_t bootsector[512];
-extern uint8_t *buf;
-extern uint8_t *buf_phys;
 
-extern bool buf_valid;
-extern off64_t buf_start_block_no;
+extern struct block_cache cache;
+extern uint8_t *xfer_buf;
+
+extern struct io_queue ioq;
 
 extern int kq;
+extern int irq_kq;
+
+extern int emmc_irq;
+extern int isrid;
+extern bool interrupt_masked;
 
 extern struct Config config;
 
+extern struct init_phase init_phases[INIT_PHASES_MAX];
+extern int ninit_phases;
+extern bool init_done;
+
+extern struct hot_list hot_record;
+extern struct hot_list hot_prefetch;
+extern uint32_t hot_prefetch_next;
+extern uint32_t hot_prefetch_chunks;
+extern struct timespec hot_record_ts;
+extern bool hot_recording;
+
 extern int nunits;
 extern struct bdev_unit unit[5];
 
@@ -43,6 +59,17 @@ profiling_extern_ts(read);
 profiling_extern_ts(write);
 profiling_extern_counter(read);
 profiling_extern_counter(write);
+profiling_extern_counter(cache_hit);
+profiling_extern_counter(cache_miss);
+profiling_extern_counter(cache_evict);
+profiling_extern_counter(readahead);
+profiling_extern_counter(direct_read);
+profiling_extern_counter(writeback);
+profiling_extern_counter(ioq_merge);
+profiling_extern_counter(discard);
+
+extern struct latency_histogram read_latency[LATENCY_SIZE_CLASSES];
+extern struct latency_histogram write_latency[LATENCY_SIZE_CLASSES];
 
 extern bool shutdown;
 
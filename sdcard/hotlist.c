@@ -0,0 +1,301 @@
+#define LOG_LEVEL_WARN
+
+#include "sys/debug.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscalls.h>
+#include <sys/param.h>
+#include <time.h>
+#include "sdcard.h"
+#include "globals.h"
+
+
+static int64_t hot_record_msec_left(void);
+static void coalesce_hot_list(struct hot_list *list);
+static int hot_extent_cmp(const void *a, const void *b);
+
+
+/* @brief   Load the hot-block list of the previous boot and start recording
+ *
+ * @return  0 on success, -1 if the hot-block list is disabled
+ *
+ * The list is kept in HOT_LIST_SZ bytes of the card at config.hot_list_block,
+ * which must lie outside every partition, for example in the gap between
+ * the MBR and the first partition. It is written by the driver itself so
+ * that it is available before any filesystem is mounted.
+ *
+ * The extents of the previous boot are prefetched into the cache in the
+ * background by service_hot_list(). The blocks read by clients during
+ * the first config.hot_record_secs seconds are recorded to replace them.
+ */
+int init_hot_list(void)
+{
+  block64_t start;
+  block64_t end;
+
+  if (config.hot_list_block == 0) {
+    return -1;
+  }
+
+  start = config.hot_list_block;
+  end = start + HOT_LIST_SZ / 512;
+
+  for (int t = 1; t < nunits; t++) {
+    if (start < unit[t].start + unit[t].blocks && end > unit[t].start) {
+      log_error("sdcard: hot-block list overlaps %s, disabled", unit[t].path);
+      config.hot_list_block = 0;
+      return -1;
+    }
+  }
+
+  if (end > unit[0].blocks || config.xfer_size < HOT_LIST_SZ) {
+    log_error("sdcard: hot-block list beyond end of card or -x too small, disabled");
+    config.hot_list_block = 0;
+    return -1;
+  }
+
+  if (bdev->read(bdev, xfer_buf, HOT_LIST_SZ, start) >= 0) {
+    memcpy(&hot_prefetch, xfer_buf, sizeof hot_prefetch);
+  }
+
+  if (hot_prefetch.magic != HOT_LIST_MAGIC || hot_prefetch.nextents > HOT_EXTENTS_MAX) {
+    log_info("sdcard: no hot-block list recorded");
+    hot_prefetch.nextents = 0;
+  }
+
+  hot_prefetch_next = 0;
+  hot_prefetch_chunks = 0;
+
+  memset(&hot_record, 0, sizeof hot_record);
+  hot_record.magic = HOT_LIST_MAGIC;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &hot_record_ts);
+  hot_recording = true;
+  return 0;
+}
+
+
+/* @brief   Record the blocks covered by a client read
+ *
+ * @param   offset, absolute byte offset of the read on the card
+ * @param   sz, size of the read in bytes
+ *
+ * A read that continues or overlaps the last extent extends it. Once the
+ * list is full it is sorted and coalesced, if that frees no space the
+ * recording is saved early.
+ */
+void record_hot_blocks(off64_t offset, size_t sz)
+{
+  struct hot_extent *last;
+  uint32_t block_no;
+  uint32_t nchunks;
+
+  if (!hot_recording || sz == 0) {
+    return;
+  }
+
+  block_no = rounddown(offset, BUF_SZ) / 512;
+  nchunks = (roundup(offset + sz, BUF_SZ) - rounddown(offset, BUF_SZ)) / BUF_SZ;
+
+  if (hot_record.nextents > 0) {
+    last = &hot_record.extents[hot_record.nextents - 1];
+
+    if (block_no >= last->block_no
+        && block_no <= last->block_no + last->nchunks * CACHE_BLOCK_NBLOCKS) {
+      last->nchunks = MAX(last->nchunks,
+                          (block_no - last->block_no) / CACHE_BLOCK_NBLOCKS + nchunks);
+      return;
+    }
+  }
+
+  if (hot_record.nextents == HOT_EXTENTS_MAX) {
+    coalesce_hot_list(&hot_record);
+
+    if (hot_record.nextents == HOT_EXTENTS_MAX) {
+      save_hot_list();
+      return;
+    }
+  }
+
+  hot_record.extents[hot_record.nextents].block_no = block_no;
+  hot_record.extents[hot_record.nextents].nchunks = nchunks;
+  hot_record.nextents++;
+}
+
+
+/* @brief   Stop recording and write the hot-block list to the card
+ *
+ * @return  0 on success, -EIO on failure
+ */
+int save_hot_list(void)
+{
+  if (!hot_recording) {
+    return 0;
+  }
+
+  hot_recording = false;
+  coalesce_hot_list(&hot_record);
+
+  memset(xfer_buf, 0, HOT_LIST_SZ);
+  memcpy(xfer_buf, &hot_record, sizeof hot_record);
+
+  if (bdev->write(bdev, xfer_buf, HOT_LIST_SZ, config.hot_list_block) < 0) {
+    log_error("sdcard: failed to save hot-block list");
+    return -EIO;
+  }
+
+  update_cache_blocks(config.hot_list_block, xfer_buf, HOT_LIST_SZ);
+
+  log_info("sdcard: saved hot-block list, %u extents", hot_record.nextents);
+  return 0;
+}
+
+
+/* @brief   Save the recording once its time is up and prefetch hot blocks
+ *
+ * Called from the main loop once pending requests have been dispatched.
+ * Each call prefetches at most config.xfer_size bytes of an extent of the
+ * previous boot, so clients wait for no more than one multi-block read.
+ * Prefetching stops once as many chunks as the cache holds have been
+ * read, as further reads would only evict hot blocks not yet used.
+ */
+void service_hot_list(void)
+{
+  struct hot_extent *extent;
+  uint32_t max_batch;
+  uint32_t nchunks;
+
+  if (hot_recording && hot_record_msec_left() <= 0) {
+    save_hot_list();
+  }
+
+  if (hot_prefetch_next >= hot_prefetch.nextents) {
+    return;
+  }
+
+  extent = &hot_prefetch.extents[hot_prefetch_next];
+  max_batch = config.xfer_size / BUF_SZ;
+  nchunks = MIN(extent->nchunks, max_batch);
+
+  if (prefetch_cache_blocks(extent->block_no, nchunks) != 0) {
+    hot_prefetch_next = hot_prefetch.nextents;
+    return;
+  }
+
+  hot_prefetch_chunks += nchunks;
+  extent->block_no += nchunks * CACHE_BLOCK_NBLOCKS;
+  extent->nchunks -= nchunks;
+
+  if (extent->nchunks == 0) {
+    hot_prefetch_next++;
+  }
+
+  if (hot_prefetch_chunks >= cache.nentries) {
+    hot_prefetch_next = hot_prefetch.nextents;
+  }
+}
+
+
+/* @brief   Limit the kevent timeout for the hot-block list
+ *
+ * @param   timeout, the timeout otherwise used, NULL to wait indefinitely
+ * @return  the timeout to use
+ *
+ * Returns a zero timeout while blocks remain to be prefetched so that the
+ * main loop polls for requests between batches, and wakes the main loop
+ * when the recording period ends.
+ */
+struct timespec *hot_list_timeout(struct timespec *timeout)
+{
+  static struct timespec hot_timeout;
+  int64_t msec;
+
+  if (hot_prefetch_next < hot_prefetch.nextents) {
+    hot_timeout.tv_sec = 0;
+    hot_timeout.tv_nsec = 0;
+    return &hot_timeout;
+  }
+
+  if (!hot_recording) {
+    return timeout;
+  }
+
+  msec = MAX(hot_record_msec_left(), 0);
+
+  if (timeout != NULL
+      && (int64_t)timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000 <= msec) {
+    return timeout;
+  }
+
+  hot_timeout.tv_sec = msec / 1000;
+  hot_timeout.tv_nsec = (msec % 1000) * 1000000;
+  return &hot_timeout;
+}
+
+
+/* @brief   Get the time left until recording of hot blocks ends
+ *
+ */
+static int64_t hot_record_msec_left(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  return (int64_t)config.hot_record_secs * 1000
+         - ((int64_t)(now.tv_sec - hot_record_ts.tv_sec) * 1000
+            + (now.tv_nsec - hot_record_ts.tv_nsec) / 1000000);
+}
+
+
+/* @brief   Sort a hot-block list and merge overlapping and adjacent extents
+ *
+ */
+static void coalesce_hot_list(struct hot_list *list)
+{
+  struct hot_extent *prev;
+  uint32_t n;
+
+  if (list->nextents == 0) {
+    return;
+  }
+
+  qsort(list->extents, list->nextents, sizeof (struct hot_extent), hot_extent_cmp);
+
+  n = 1;
+
+  for (uint32_t t = 1; t < list->nextents; t++) {
+    prev = &list->extents[n - 1];
+
+    if (list->extents[t].block_no <= prev->block_no + prev->nchunks * CACHE_BLOCK_NBLOCKS) {
+      prev->nchunks = MAX(prev->nchunks,
+                          (list->extents[t].block_no - prev->block_no) / CACHE_BLOCK_NBLOCKS
+                          + list->extents[t].nchunks);
+    } else {
+      list->extents[n++] = list->extents[t];
+    }
+  }
+
+  list->nextents = n;
+}
+
+
+/*
+ *
+ */
+static int hot_extent_cmp(const void *a, const void *b)
+{
+  const struct hot_extent *ea = a;
+  const struct hot_extent *eb = b;
+
+  if (ea->block_no < eb->block_no) {
+    return -1;
+  } else if (ea->block_no > eb->block_no) {
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,178 @@
+#define LOG_LEVEL_WARN
+
+#include "sys/debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscalls.h>
+#include <time.h>
+#include <unistd.h>
+#include "sdcard.h"
+#include "globals.h"
+
+
+// @brief   A block device backed by a disk image file
+struct image_block_dev
+{
+  struct block_device bd;
+  int fd;
+};
+
+
+static int image_read(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t block_no);
+static int image_write(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t block_no);
+static int image_xfer(struct image_block_dev *idev, uint8_t *buf, size_t buf_size,
+                      uint32_t block_no, bool is_write);
+static void image_delay(size_t sz);
+
+
+static char image_driver_name[] = "image";
+
+
+/* @brief   Open a disk image file to serve blocks from instead of the card
+ *
+ * @param   dev, set to the new block device on success
+ * @param   path, pathname of the disk image
+ * @return  0 on success, negative errno on failure
+ *
+ * The image is accessed with ordinary file reads and writes. Each command
+ * is delayed according to config.model_latency and config.model_bandwidth
+ * so that the cache, read-ahead and request queue can be measured against
+ * a device with known timing, without depending on the card in the slot.
+ *
+ * This is a backend of the driver running on CheviotOS, the driver is not
+ * built for other hosts and there is no shim for the message calls.
+ *
+ * TODO: Host build with a shim for the message calls, see README.md
+ */
+int image_init(struct block_device **dev, char *path)
+{
+  struct image_block_dev *idev;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDWR);
+
+  if (fd < 0) {
+    log_error("cannot open image %s", path);
+    return -errno;
+  }
+
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -EIO;
+  }
+
+  idev = calloc(1, sizeof (struct image_block_dev));
+
+  if (idev == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  idev->fd = fd;
+  idev->bd.driver_name = image_driver_name;
+  idev->bd.device_name = path;
+  idev->bd.block_size = 512;
+  idev->bd.num_blocks = st.st_size / 512;
+  idev->bd.supports_multiple_block_read = 1;
+  idev->bd.supports_multiple_block_write = 1;
+  idev->bd.read = image_read;
+  idev->bd.write = image_write;
+
+  log_info("image %s, %u blocks", path, (uint32_t)idev->bd.num_blocks);
+
+  *dev = &idev->bd;
+  return 0;
+}
+
+
+/*
+ *
+ */
+static int image_read(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t block_no)
+{
+  return image_xfer((struct image_block_dev *)dev, buf, buf_size, block_no, false);
+}
+
+
+/*
+ *
+ */
+static int image_write(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t block_no)
+{
+  return image_xfer((struct image_block_dev *)dev, buf, buf_size, block_no, true);
+}
+
+
+/* @brief   Read or write a range of blocks of the image file
+ *
+ * @param   idev, the image block device
+ * @param   buf, buffer to read into or write from
+ * @param   buf_size, size of the transfer in bytes
+ * @param   block_no, first 512 byte block
+ * @param   is_write, true to write, false to read
+ * @return  buf_size on success, -1 on failure
+ *
+ * Short reads and writes are continued until the whole range has been
+ * transferred, reaching the end of the image is a failure.
+ */
+static int image_xfer(struct image_block_dev *idev, uint8_t *buf, size_t buf_size,
+                      uint32_t block_no, bool is_write)
+{
+  size_t xfered = 0;
+  ssize_t sc;
+
+  if (lseek64(idev->fd, (off64_t)block_no * 512, SEEK_SET) < 0) {
+    return -1;
+  }
+
+  while (xfered < buf_size) {
+    if (is_write) {
+      sc = write(idev->fd, buf + xfered, buf_size - xfered);
+    } else {
+      sc = read(idev->fd, buf + xfered, buf_size - xfered);
+    }
+
+    if (sc < 0 && errno == EINTR) {
+      continue;
+    } else if (sc <= 0) {
+      return -1;
+    }
+
+    xfered += sc;
+  }
+
+  image_delay(buf_size);
+  return buf_size;
+}
+
+
+/* @brief   Delay for the modelled time of a command transferring sz bytes
+ *
+ */
+static void image_delay(size_t sz)
+{
+  struct timespec req;
+  uint64_t usec;
+
+  usec = config.model_latency;
+
+  if (config.model_bandwidth != 0) {
+    usec += ((uint64_t)sz * 1000000) / ((uint64_t)config.model_bandwidth * 1024);
+  }
+
+  if (usec == 0) {
+    return;
+  }
+
+  req.tv_sec = usec / 1000000;
+  req.tv_nsec = (usec % 1000000) * 1000;
+
+  while (nanosleep(&req, &req) != 0);
+}
@@ -17,6 +17,7 @@
 #include <poll.h>
 #include <unistd.h>
 #include <sys/event.h>
+#include <sys/interrupts.h>
 #include <machine/cheviot_hal.h>
 #include <sys/rpi_mailbox.h>
 #include <sys/rpi_gpio.h>
@@ -34,6 +35,7 @@
  */
 void init(int argc, char *argv[])
 {
+  struct timespec phase_ts;
   int sc;
 
   sc = process_args(argc, argv);
@@ -42,26 +44,27 @@ void init(int argc, char *argv[])
     exit(-1);
   }
 
-	sc = enable_power_and_clocks();
-	if (sc != 0) {
-		log_error("enable_power_and_clocks failed, sc = %d", sc);
-		exit(-1);
-	}
+  clock_gettime(CLOCK_MONOTONIC_RAW, &phase_ts);
 
-  sc = map_io_registers();
-  if (sc != 0) {
-    log_error("map_io_registers failed, sc = %d", sc);
-    exit(-1);
-  }
-  	
   bdev = NULL;
 
-  sc = sd_card_init(&bdev);
-  if (sc < 0) {
-    log_error("sd_card_init failed, sc = %d", sc);
-    exit(-1);
+  if (config.image_path[0] != '\0') {
+    sc = image_init(&bdev, config.image_path);
+    if (sc != 0) {
+      log_error("image_init failed, sc = %d", sc);
+      exit(-1);
+    }
+
+    record_init_phase("image", &phase_ts);
+  } else {
+    sc = init_emmc();
+    if (sc != 0) {
+      exit(-1);
+    }
   }
 
+  clock_gettime(CLOCK_MONOTONIC_RAW, &phase_ts);
+
   kq = kqueue();
   if (kq < 0) {
     log_error("failed to create kqueue");
@@ -78,24 +81,93 @@ void init(int argc, char *argv[])
     exit(-1);
   }
 
-  buf = mmap((void *)MMAP_START_BASE, BUF_SZ, PROT_READ | PROT_WRITE, 0, -1, 0);
+  for (int t = 0; t < nunits; t++) {
+    reset_unit_stats(&unit[t]);
+  }
+
+  record_init_phase("mounts", &phase_ts);
 
-  if (buf == MAP_FAILED) {
-    log_error("failed to create 4k buffer");
+  sc = init_cache(config.cache_blocks);
+  if (sc != 0) {
+    log_error("failed to create block cache, sc = %d", sc);
     exit(-1);
   }
-  
-  buf_phys = virtualtophysaddr(buf);
+
+  if (alloc_xfer_buf(config.xfer_size) != 0) {
+    log_error("failed to create transfer buffer");
+    exit(-1);
+  }
+
+  record_init_phase("buffers", &phase_ts);
+
+  if (init_hot_list() == 0) {
+    record_init_phase("hot list", &phase_ts);
+  }
+
+  init_done = true;
   
   _swi_setschedparams(SCHED_RR, SDCARD_TASK_PRIORITY);
 }
 
 
+/* @brief   Bring up the EMMC controller and the card in its slot
+ *
+ * @return  0 on success, non-zero on failure
+ */
+int init_emmc(void)
+{
+  struct timespec phase_ts;
+  int sc;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &phase_ts);
+  
+	sc = enable_power_and_clocks();
+	if (sc != 0) {
+		log_error("enable_power_and_clocks failed, sc = %d", sc);
+		return -1;
+	}
+
+  sc = map_io_registers();
+  if (sc != 0) {
+    log_error("map_io_registers failed, sc = %d", sc);
+    return -1;
+  }
+  	
+  sc = init_interrupts();
+  if (sc != 0) {
+    log_warn("EMMC interrupts unavailable, polling for completion");
+  }
+
+  record_init_phase("map registers", &phase_ts);
+
+  sc = sd_card_init(&bdev);
+  if (sc < 0) {
+    log_error("sd_card_init failed, sc = %d", sc);
+    return -1;
+  }
+
+  return 0;
+}
+
+
 /*
  * -u default user-id
  * -g default gid
  * -m default mod bits
  * -D debug level ?
+ * -c number of BUF_SZ entries in the block cache
+ * -r maximum read-ahead window in bytes, 0 to disable
+ * -t size in bytes from which reads bypass the cache, 0 to disable
+ * -x maximum size of a multi-block transfer in bytes
+ * -w enable write-back caching, maximum age of dirty blocks in ms
+ * -i disk image to serve blocks from instead of the card
+ * -s disk image of a simulated card, requires EMMC_SIMULATOR
+ * -l modelled latency per command in us
+ * -b image file bandwidth in KB/s, 0 for unlimited
+ * -p modelled busy time of the simulated card per write in us
+ * -f fast boot, poll for the controller and card rather than sleeping
+ * -k block of the hot-block list, outside any partition, see hotlist.c
+ * -e seconds reads are recorded in the hot-block list after start
  * mount path (default arg)
  */
 int process_args(int argc, char *argv[]) 
@@ -106,13 +178,26 @@ int process_args(int argc, char *argv[])
 	config.gid = 0;
 	config.dev = -1;
 	config.mode = 0600;
+	config.cache_blocks = CACHE_BLOCKS_DEFAULT;
+	config.readahead_max = READAHEAD_MAX_DEFAULT;
+	config.xfer_size = XFER_SZ_DEFAULT;
+	config.direct_read_min = DIRECT_READ_DEFAULT;
+	config.writeback_delay = 0;
+	config.image_path[0] = '\0';
+	config.model_latency = 0;
+	config.model_bandwidth = 0;
+	config.sim_path[0] = '\0';
+	config.model_busy = 0;
+	config.fast_boot = false;
+	config.hot_list_block = 0;
+	config.hot_record_secs = HOT_RECORD_SECS_DEFAULT;
 
   if (argc <= 1) {
     log_error("process_args argc <=1, %d", argc);
     return -1;
   }
 
-  while ((c = getopt(argc, argv, "u:g:m:d:")) != -1) {
+  while ((c = getopt(argc, argv, "u:g:m:d:c:r:x:t:w:i:l:b:s:p:fk:e:")) != -1) {
     switch (c) {
     case 'u':
       config.uid = strtoul(optarg, NULL, 0);
@@ -130,9 +215,74 @@ int process_args(int argc, char *argv[])
       config.dev = strtoul(optarg, NULL, 0);
       break;
 
+    case 'c':
+      config.cache_blocks = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'r':
+      config.readahead_max = rounddown(strtoul(optarg, NULL, 0), BUF_SZ);
+      break;
+
+    case 'x':
+      config.xfer_size = rounddown(strtoul(optarg, NULL, 0), BUF_SZ);
+      break;
+
+    case 't':
+      config.direct_read_min = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'w':
+      config.writeback_delay = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'i':
+      strlcpy(config.image_path, optarg, sizeof config.image_path);
+      break;
+
+    case 'l':
+      config.model_latency = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'b':
+      config.model_bandwidth = strtoul(optarg, NULL, 0);
+      break;
+
+    case 's':
+      strlcpy(config.sim_path, optarg, sizeof config.sim_path);
+      break;
+
+    case 'p':
+      config.model_busy = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'f':
+      config.fast_boot = true;
+      break;
+
+    case 'k':
+      config.hot_list_block = strtoull(optarg, NULL, 0);
+      break;
+
+    case 'e':
+      config.hot_record_secs = strtoul(optarg, NULL, 0);
+      break;
+
     }
   }
 
+#ifndef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    log_error("-s requires the driver to be built with EMMC_SIMULATOR");
+    return -1;
+  }
+#endif
+
+  if (config.xfer_size < BUF_SZ) {
+    config.xfer_size = BUF_SZ;
+  } else if (config.xfer_size > XFER_SZ_MAX) {
+    config.xfer_size = XFER_SZ_MAX;
+  }
+
   if (optind >= argc) {
     log_error("process_args failed, optind = %d, argc = %d", optind, argc);
     return -1;
@@ -143,6 +293,76 @@ int process_args(int argc, char *argv[])
 }
 
 
+/* @brief   Allocate or replace the staging buffer for multi-block transfers
+ *
+ * @param   xfer_size, size of the buffer, a multiple of BUF_SZ
+ * @return  0 on success, -ENOMEM on failure with the current buffer kept
+ *
+ * Also used by the config sendio command to resize the buffer between
+ * requests, xfer_buf holds no data from one request to the next.
+ */
+int alloc_xfer_buf(size_t xfer_size)
+{
+  uint8_t *buf;
+
+  buf = mmap((void *)MMAP_START_BASE, xfer_size, PROT_READ | PROT_WRITE, 0, -1, 0);
+
+  if (buf == MAP_FAILED) {
+    return -ENOMEM;
+  }
+
+  if (xfer_buf != NULL) {
+    munmap(xfer_buf, config.xfer_size);
+  }
+
+  xfer_buf = buf;
+  config.xfer_size = xfer_size;
+  return 0;
+}
+
+
+/* @brief   Record the time taken by a phase of initialization
+ *
+ * @param   name, name of the phase reported by debug init
+ * @param   phase_ts, time the phase started, set to now for the next phase
+ *
+ * Only the initialization done by init() is recorded, not the card being
+ * re-initialized after an error.
+ */
+void record_init_phase(char *name, struct timespec *phase_ts)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  if (!init_done && ninit_phases < INIT_PHASES_MAX) {
+    init_phases[ninit_phases].name = name;
+    init_phases[ninit_phases].usec = (now.tv_sec - phase_ts->tv_sec) * 1000000
+                                     + (now.tv_nsec - phase_ts->tv_nsec) / 1000;
+    ninit_phases++;
+  }
+
+  *phase_ts = now;
+}
+
+
+/* @brief   Get the I/O size reported to clients in st_blksize
+ *
+ * @return  the largest transfer the driver makes, limited to the card's
+ *          allocation unit so that aligned clients never straddle an AU
+ */
+blksize_t preferred_io_size(void)
+{
+  size_t sz = config.xfer_size;
+
+  if (bdev->au_size != 0 && bdev->au_size < sz) {
+    sz = bdev->au_size;
+  }
+
+  return sz;
+}
+
+
 /*
  *
  */
@@ -167,6 +387,12 @@ int enable_power_and_clocks(void)
  */
 int map_io_registers(void)
 {
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    return emmc_sim_init(config.sim_path);
+  }
+#endif
+
   if (get_fdt_device_info() != 0) {
     return -EIO;
   }
@@ -229,11 +455,58 @@ int get_fdt_device_info(void)
     return -EIO;        
   }
 
+  if (fdthelper_get_irq(helper.fdt, offset, &emmc_irq) != 0) {
+    log_warn("cannot get emmc2 interrupt");
+    emmc_irq = -1;
+  }
+
   unload_fdt(&helper);
   return 0;  
 }
 
 
+/* @brief   Route the EMMC interrupt to this driver
+ *
+ * @return  0 on success, negative errno if interrupts are unavailable
+ *
+ * Completion of commands and transfers is signalled by a thread event
+ * on a kqueue of its own, separate from the message port kqueue, so that
+ * sd_wait_interrupt() only wakes up for the EMMC interrupt. The interrupt
+ * is masked until the first wait and is masked again by the kernel each
+ * time it is raised. If this fails, or the card is simulated, the driver
+ * polls instead.
+ */
+int init_interrupts(void)
+{
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    log_info("simulated card raises no interrupt");
+    return -ENODEV;
+  }
+#endif
+
+  if (emmc_irq < 0) {
+    return -EINVAL;
+  }
+
+  irq_kq = kqueue();
+  if (irq_kq < 0) {
+    return -ENOMEM;
+  }
+
+  isrid = addinterruptserver(emmc_irq, EVENT_EMMC_INT);
+  if (isrid < 0) {
+    close(irq_kq);
+    irq_kq = -1;
+    return -EINVAL;
+  }
+
+  interrupt_masked = true;
+  cthread_event_kevent_mask(irq_kq, 1<<EVENT_EMMC_INT);
+  return 0;
+}
+
+
 /* @brief   Create a block special device mount covering the whole disk
  *
  * @returns 0 on success, -1 on failure
@@ -258,7 +531,7 @@ int create_device_mount(void)
   mnt_stat.st_mode = _IFBLK | (config.mode & 0777);
   mnt_stat.st_uid = config.uid;
   mnt_stat.st_gid = config.gid;
-  mnt_stat.st_blksize = 512;
+  mnt_stat.st_blksize = preferred_io_size();
   mnt_stat.st_size = 0xFFFFFFFF;     // FIXME: Needs stat64 for drives 4GB and over
   mnt_stat.st_blocks = 33554432ull;
 
@@ -294,7 +567,7 @@ int create_partition_mounts(void)
   struct mbr_partition_table_entry mbr_partition_table[4];  
   struct stat mnt_stat;
    
-  sc = sd_read(bdev, bootsector, 512, 0);
+  sc = bdev->read(bdev, bootsector, 512, 0);
   
   if (sc < 0) {
     log_error("failed to read bootsector");
@@ -321,7 +594,7 @@ int create_partition_mounts(void)
       mnt_stat.st_mode = _IFBLK | (config.mode & 0777);
       mnt_stat.st_uid = config.uid;
       mnt_stat.st_gid = config.gid;
-      mnt_stat.st_blksize = 512;
+      mnt_stat.st_blksize = preferred_io_size();
       mnt_stat.st_size = unit[nunits].size;  
       mnt_stat.st_blocks = unit[nunits].blocks;
 
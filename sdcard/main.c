@@ -1,9 +1,9 @@
-
 #define LOG_LEVEL_WARN
 
 #include "sys/debug.h"
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,6 +26,11 @@
 #include <sys/profiling.h>
 
 
+static void sdcard_read_direct(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req,
+                               struct timespec *arrival_ts, struct timespec *start_ts);
+static int discard_range_cmp(const void *a, const void *b);
+
+
 /* @brief   The SDCard block device driver
  *
  * @param   argc, argument count passed on command line
@@ -34,15 +39,16 @@
  *
  * The SDCard driver mounts the whole block device and also
  * individual detected partitions as separate mount points.
+ *
+ * When any port has messages, all ports are drained into the request
+ * queue which is then serviced in elevator order by dispatch_queue().
  */
 int main(int argc, char *argv[])
 {
-  iorequest_t req;
   int sc;
+  int nevents;
+  int status = 0;
   struct kevent ev;
-  int portid;
-  msgid_t msgid;
-  struct bdev_unit *unit;
    
   init(argc, argv);  
 
@@ -56,43 +62,43 @@ int main(int argc, char *argv[])
   }
 
   while (!shutdown) {
-    kevent(kq, NULL, 0, &ev, 1, NULL);
+    nevents = kevent(kq, NULL, 0, &ev, 1, hot_list_timeout(writeback_timeout()));
 		    
-    if (ev.filter == EVFILT_MSGPORT) {
-      portid = ev.ident;
-      unit = ev.udata;
-
-      while ((sc = getmsg(portid, &msgid, &req, sizeof req)) == sizeof req) {
-        switch (req.cmd) {
-          case CMD_READ:
-            sdcard_read(unit, msgid, &req);
-            break;
-
-          case CMD_WRITE:
-            sdcard_write(unit, msgid, &req);
-            break;
-
-          case CMD_SENDIO:
-            sdcard_sendio(unit, msgid, &req);
-            break;
-
-          default:
-            log_warn("sdcard: unknown command: %d", req.cmd);
-            replymsg(portid, msgid, -ENOTSUP, NULL, 0);
+    if (nevents == 1 && ev.filter == EVFILT_MSGPORT) {
+      do {
+        sc = 0;
+        
+        for (int t = 0; t < nunits && sc <= 0; t++) {
+          sc = queue_messages(&unit[t]);
+
+          if (sc < 0) {
+            // Shut down so that acknowledged writes are still flushed
+            log_error("sdcard: cannot receive messages, shutting down");
+            abort_queue(-EIO);
+            shutdown = true;
+            status = EXIT_FAILURE;
             break;
+          }
         }
-      }
-      
-      if (sc != 0) {
-        log_error("sdcard: getmsg sc=%d %s", sc, strerror(errno));
-        exit(EXIT_FAILURE);
-      }
-    } else {
+
+        dispatch_queue();
+      } while (sc == 1);
+    } else if (nevents == 1) {
       log_warn("unhandled kevent filter:%d", ev.filter);
     }
+    
+    writeback_cache();
+    service_hot_list();
   }
 
-  exit(0);
+  save_hot_list();
+
+  if (flush_cache() != 0) {
+    log_error("sdcard: failed to flush cache on shutdown");
+    exit(EXIT_FAILURE);
+  }
+  
+  exit(status);
 }
 
 
@@ -101,15 +107,20 @@ int main(int argc, char *argv[])
  * @param   unit, parameters and state of the whole device or a partition
  * @param   msgid, message id returned by receivemsg
  * @param   req, filesystem request message header
+ * @param   arrival_ts, time the request was received, latency is measured from it
  *
  * This assumes blocks are 512 bytes in size 
- * sdcard_read() currently implements a simple BUF_SZ (4096 byte) cache.
- * Read operations read a full BUF_SZ into the buffer.
+ * Reads are serviced from the block cache in BUF_SZ (4096 byte) chunks
+ * aligned to the start of the whole disk, so that partitions share cached
+ * blocks with the whole-disk unit. Sequential reads are detected by
+ * sdcard_readahead() which fills the cache ahead of the reader.
+ * Large block aligned reads bypass the cache, see sdcard_read_direct().
  *
  * TODO: Check for block alignment of offset and size
  * TODO: Check within range of unit 
  */
-void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req,
+                 struct timespec *arrival_ts)
 {
   off64_t block_no;
   off64_t offset;
@@ -118,29 +129,51 @@ void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
   size_t chunk_size;  
   size_t left;
   size_t xfered;
-  size_t block_read_sz;
-  int sc;
+  struct cache_block *cblk;
+  struct timespec start_ts;
 
   profiling_begin(read);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+
+  record_hot_blocks((off64_t)unit->start * 512 + req->args.read.offset, req->args.read.sz);
+
+  if (is_direct_read(req)) {
+    sdcard_read_direct(unit, msgid, req, arrival_ts, &start_ts);
+    return;
+  }
 
   xfered = 0;
-  offset = req->args.read.offset;
+  offset = (off64_t)unit->start * 512 + req->args.read.offset;
   remaining = req->args.read.sz;  
 
+  sdcard_readahead(unit, req->args.read.offset, req->args.read.sz);
+
   while (remaining > 0) {
-    block_no = ((off64_t)unit->start + (rounddown(offset, BUF_SZ)) / 512 );
+    block_no = rounddown(offset, BUF_SZ) / 512;
     chunk_start = offset % BUF_SZ;
     left = BUF_SZ - chunk_start;
 
-    if (buf_valid != true || block_no != buf_start_block_no) {
-      sc = sd_read(bdev, buf, BUF_SZ, block_no);
-      buf_start_block_no = block_no;
-      buf_valid = true;
+    cblk = find_cache_block(block_no);
+
+    if (cblk != NULL) {
+      profiling_count(cache_hit);
+      unit->stats.cache_hits++;
+    } else {
+      unit->stats.cache_misses++;
+      cblk = get_cache_block(block_no);
+    }
+    
+    if (cblk == NULL) {
+      replymsg(unit->portid, msgid, -EIO, NULL, 0);
+      account_request(unit, false, req->args.read.offset, req->args.read.sz, arrival_ts, &start_ts);
+      profiling_end_usec(read);
+      profiling_count(read);
+      return;
     }
 
     chunk_size = (left < remaining) ? left : remaining;
     
-    writemsg(unit->portid, msgid, buf+chunk_start, chunk_size, xfered);
+    writemsg(unit->portid, msgid, cblk->data + chunk_start, chunk_size, xfered);
 
     xfered += chunk_size;
     offset += chunk_size;
@@ -149,8 +182,79 @@ void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
 
   replymsg(unit->portid, msgid, xfered, NULL, 0);
 
+  account_request(unit, false, req->args.read.offset, req->args.read.sz, arrival_ts, &start_ts);
+  profiling_end_usec(read);
+  profiling_count(read);
+}
+
+
+/* @brief   Check if a read is large enough to bypass the cache
+ *
+ * @param   req, a CMD_READ request
+ * @return  true if the read is handled by sdcard_read_direct()
+ */
+bool is_direct_read(iorequest_t *req)
+{
+  if (config.direct_read_min == 0 || req->args.read.sz < config.direct_read_min) {
+    return false;
+  }
+
+  return (req->args.read.offset % 512 == 0 && req->args.read.sz % 512 == 0);
+}
+
+
+/* @brief   Read a large request straight from the card into xfer_buf
+ *
+ * @param   unit, parameters and state of the whole device or a partition
+ * @param   msgid, message id returned by receivemsg
+ * @param   req, a CMD_READ request accepted by is_direct_read()
+ * @param   arrival_ts, time the request was received
+ * @param   start_ts, time the request started being serviced
+ *
+ * The request is read with multi-block reads of up to config.xfer_size
+ * into xfer_buf, each copied to the client with a single writemsg(). Bulk
+ * reads then run at the speed of the bus rather than one BUF_SZ command
+ * at a time, and do not evict the working set from the cache. Blocks
+ * that are already cached, possibly dirty, are copied over the data read
+ * as the cache is never older than the card.
+ */
+static void sdcard_read_direct(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req,
+                               struct timespec *arrival_ts, struct timespec *start_ts)
+{
+  off64_t offset;
+  size_t remaining;
+  size_t chunk_size;
+  size_t xfered;
+  int sc = 0;
+
+  xfered = 0;
+  offset = (off64_t)unit->start * 512 + req->args.read.offset;
+  remaining = req->args.read.sz;
+
+  while (remaining > 0) {
+    chunk_size = MIN(remaining, config.xfer_size);
+
+    sc = bdev->read(bdev, xfer_buf, chunk_size, offset / 512);
+
+    if (sc < 0) {
+      break;
+    }
+
+    copy_cached_blocks(offset / 512, xfer_buf, chunk_size);
+    writemsg(unit->portid, msgid, xfer_buf, chunk_size, xfered);
+
+    xfered += chunk_size;
+    offset += chunk_size;
+    remaining -= chunk_size;
+  }
+
+  replymsg(unit->portid, msgid, (sc < 0) ? -EIO : (int)xfered, NULL, 0);
+
+  unit->stats.direct_reads++;
+  account_request(unit, false, req->args.read.offset, req->args.read.sz, arrival_ts, start_ts);
   profiling_end_usec(read);
   profiling_count(read);
+  profiling_count(direct_read);
 }
 
 
@@ -159,68 +263,141 @@ void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
  * @param   unit, parameters and state of the whole device or a partition
  * @param   msgid, message id returned by receivemsg
  * @param   req, filesystem request message header
+ * @param   arrival_ts, time the request was received, latency is measured from it
+ *
+ * Runs of whole BUF_SZ chunks are written with a single multi-block
+ * write of up to config.xfer_size bytes. A partial chunk is written as
+ * the 512 byte blocks it covers, the chunk is first read through the
+ * cache only if the write does not start and end on a block boundary.
+ *
+ * In write-through mode the cache is updated once the card has accepted
+ * the data. In write-back mode the data is only copied into the cache and
+ * the blocks are marked dirty, writeback_cache() writes them out later.
  *
  * TODO: Check for block alignment of offset and size
  * TODO: Check within range of unit
- *
- * FIXME: We break down writes into 512 byte chunks as larger writes
- * seem to cause an error where the controller is reinitialized by
- * calling sd)card_init.
  */
- 
-void sdcard_write(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+void sdcard_write(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req,
+                  struct timespec *arrival_ts)
 {
   off64_t block_no;
   off64_t offset;
   size_t remaining;
   off_t chunk_start;
   size_t chunk_size;  
-  size_t left;
   size_t xfered;
-  size_t block_write_sz;
+  off_t write_start;
+  size_t write_sz;
+  struct cache_block *cblk;
+  struct timespec start_ts;
   int sc;
 
   profiling_begin(write);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
 
   xfered = 0;
-  offset = req->args.write.offset;
+  offset = (off64_t)unit->start * 512 + req->args.write.offset;
   remaining = req->args.write.sz;  
 
-  buf_valid = false;
-  
   while (remaining > 0) {
-    block_no = ((off64_t)unit->start + (offset / 512));
-    chunk_start = offset % 512;
-    left = BUF_SZ - chunk_start;
+    block_no = rounddown(offset, BUF_SZ) / 512;
+    chunk_start = offset % BUF_SZ;
 
-    chunk_size = (left < remaining) ? left : remaining;
+    if (config.writeback_delay > 0) {
+      chunk_size = MIN(BUF_SZ - chunk_start, remaining);
+      
+      if (chunk_size == BUF_SZ) {
+        cblk = new_cache_block(block_no);
+      } else {
+        cblk = get_cache_block(block_no);
+      }
+      
+      if (cblk == NULL) {
+        break;
+      }
+      
+      readmsg(unit->portid, msgid, cblk->data + chunk_start, chunk_size, xfered);
+      mark_cache_block_dirty(cblk);
 
-    block_write_sz = roundup(chunk_start + chunk_size, 512);
+      xfered += chunk_size;
+      offset += chunk_size;
+      remaining -= chunk_size;
+      continue;
+    }
+    
+    if (chunk_start == 0 && remaining >= BUF_SZ) {
+      chunk_size = au_limit(offset, MIN(rounddown(remaining, BUF_SZ), config.xfer_size));
+      write_start = 0;
+      write_sz = chunk_size;
 
-    if (chunk_start != 0 || (chunk_size % 512) != 0) {
-      for (int xfered = 0; xfered < block_write_sz; xfered += 512) {
-        sc = sd_read(bdev, (uint8_t *)buf + xfered, 512, block_no + xfered/512);
-      }    
+      readmsg(unit->portid, msgid, xfer_buf, chunk_size, xfered);
+    } else {
+      chunk_size = MIN(BUF_SZ - chunk_start, remaining);
+      write_start = rounddown(chunk_start, 512);
+      write_sz = roundup(chunk_start + chunk_size, 512) - write_start;
+
+      if ((chunk_start % 512) != 0 || (chunk_size % 512) != 0) {
+        cblk = get_cache_block(block_no);
+
+        if (cblk == NULL) {
+          break;
+        }
+
+        memcpy(xfer_buf, cblk->data, BUF_SZ);
+      }
+
+      readmsg(unit->portid, msgid, xfer_buf + chunk_start, chunk_size, xfered);
     }
 
-    readmsg(unit->portid, msgid, buf+chunk_start, chunk_size, xfered);
+    sc = bdev->write(bdev, xfer_buf + write_start, write_sz, block_no + write_start / 512);
+
+    if (sc < 0) {
+      break;
+    }
 
-    for (int xfered = 0; xfered < block_write_sz; xfered += 512) {
-      sc = sd_write(bdev, (uint8_t *)buf + xfered, 512, block_no + xfered/512);
-    }    
+    update_cache_blocks(block_no + write_start / 512, xfer_buf + write_start, write_sz);
 
     xfered += chunk_size;
     offset += chunk_size;
     remaining -= chunk_size;
   }
 
-  replymsg(unit->portid, msgid, xfered, NULL, 0);
-
+  if (remaining > 0) {
+    replymsg(unit->portid, msgid, -EIO, NULL, 0);
+  } else {
+    replymsg(unit->portid, msgid, xfered, NULL, 0);
+  }
+  
+  account_request(unit, true, req->args.write.offset, req->args.write.sz, arrival_ts, &start_ts);
   profiling_end_usec(write);
   profiling_count(write);
 }
 
 
+/* @brief   Limit the size of a write so it does not cross an allocation unit
+ *
+ * @param   offset, absolute byte offset of the write on the card
+ * @param   sz, size of the write in bytes
+ * @return  sz, or the bytes up to the next AU boundary if that is less
+ *
+ * A write that straddles two AUs can make the card garbage collect both,
+ * splitting it at the boundary keeps each write within one AU. AUs are
+ * multiples of BUF_SZ so BUF_SZ aligned writes stay BUF_SZ aligned.
+ */
+size_t au_limit(off64_t offset, size_t sz)
+{
+  size_t au_size = bdev->au_size;
+  size_t left;
+
+  if (au_size == 0) {
+    return sz;
+  }
+
+  left = au_size - (offset % au_size);
+  return MIN(sz, left);
+}
+
+
 /*
  *
  */ 
@@ -256,6 +433,12 @@ void sdcard_sendio(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
       cmd_profiling(unit, msgid, req);
     } else if (strcmp("debug", cmd) == 0) {
       cmd_debug(unit, msgid, req);
+    } else if (strcmp("flush", cmd) == 0) {
+      cmd_flush(unit, msgid, req);
+    } else if (strcmp("discard", cmd) == 0) {
+      cmd_discard(unit, msgid, req);
+    } else if (strcmp("config", cmd) == 0) {
+      cmd_config(unit, msgid, req);
     } else {
       strlcpy(resp_buf, "ERROR: unknown command\n", sizeof resp_buf);   
     }
@@ -281,7 +464,20 @@ void cmd_help(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
                      "profiling enable  - enable profiling\n" 
                      "profiling disable - diable profiling\n" 
                      "profiling reset   - reset statistics\n"
-                     "debug registers   - dump registers\n",
+                     "profiling unit    - get statistics of this unit\n"
+                     "debug registers   - dump registers\n"
+                     "debug card        - show card bus width and speed\n"
+                     "debug trace dump  - list recent commands\n"
+                     "debug trace clear - clear command trace\n"
+                     "debug init        - show initialization phase times\n"
+                     "debug pio [n]     - time programmed I/O of n blocks\n"
+                     "debug recovery    - show error recovery counters\n"
+                     "debug recovery clear - clear error recovery counters\n"
+                     "flush             - write dirty cached blocks\n"
+                     "discard <offset> <size> ... - erase unused ranges\n"
+                     "config            - show buffer and cache settings\n"
+                     "config <name> <value> - change cache, xfer, readahead,\n"
+                     "                    direct or writeback\n",
                      sizeof resp_buf);
 }
 
@@ -289,6 +485,207 @@ void cmd_help(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
 /*
  *
  */
+void cmd_flush(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  if (flush_cache() != 0) {
+    snprintf(resp_buf, sizeof resp_buf, "ERROR: flush failed, %d dirty blocks not written, "
+             "%d write-back errors\n", cache.ndirty, cache.writeback_errors);
+  } else {
+    strlcpy(resp_buf, "OK: flushed\n", sizeof resp_buf);
+  }
+}
+
+
+/* @brief   Show or change the buffer and cache settings
+ *
+ * With no arguments the current settings are listed. Otherwise a setting
+ * is changed while the driver runs, the same as the command line option:
+ *
+ *   cache <n>          entries in the block cache (-c)
+ *   xfer <bytes>       largest multi-block transfer (-x)
+ *   readahead <bytes>  maximum read-ahead window (-r)
+ *   direct <bytes>     reads of this size bypass the cache (-t)
+ *   writeback <ms>     maximum age of dirty blocks, 0 for write-through (-w)
+ *
+ * Sendio commands are handled between requests, so the cache and
+ * xfer_buf can be replaced without affecting a request in progress.
+ */
+void cmd_config(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  char *name;
+  char *arg;
+  unsigned long val;
+  int sc = 0;
+
+  name = strtok(NULL, " ");
+
+  if (name == NULL) {
+    snprintf(resp_buf, sizeof resp_buf, "OK: config\n"
+              "cache: %d\n"
+              "xfer: %u\n"
+              "readahead: %u\n"
+              "direct: %u\n"
+              "writeback: %d\n",
+              cache.nentries,
+              (uint32_t)config.xfer_size,
+              (uint32_t)config.readahead_max,
+              (uint32_t)config.direct_read_min,
+              config.writeback_delay);
+    return;
+  }
+
+  arg = strtok(NULL, " ");
+
+  if (arg == NULL) {
+    strlcpy(resp_buf, "ERROR: no value\n", sizeof resp_buf);
+    return;
+  }
+
+  val = strtoul(arg, NULL, 0);
+
+  if (strcmp("cache", name) == 0) {
+    if (val == 0 || val > INT_MAX / BUF_SZ) {
+      sc = -EINVAL;
+    } else if ((sc = resize_cache(val)) == 0) {
+      config.cache_blocks = val;
+    }
+  } else if (strcmp("xfer", name) == 0) {
+    val = rounddown(val, BUF_SZ);
+
+    if (val < BUF_SZ || val > XFER_SZ_MAX
+        || (config.hot_list_block != 0 && val < HOT_LIST_SZ)) {
+      sc = -EINVAL;
+    } else {
+      sc = alloc_xfer_buf(val);
+    }
+  } else if (strcmp("readahead", name) == 0) {
+    config.readahead_max = rounddown(val, BUF_SZ);
+  } else if (strcmp("direct", name) == 0) {
+    config.direct_read_min = val;
+  } else if (strcmp("writeback", name) == 0) {
+    // Write-through mode expects no dirty blocks in the cache
+    if (val == 0 && flush_cache() != 0) {
+      sc = -EIO;
+    } else {
+      config.writeback_delay = val;
+    }
+  } else {
+    strlcpy(resp_buf, "ERROR: unknown setting\n", sizeof resp_buf);
+    return;
+  }
+
+  if (sc != 0) {
+    snprintf(resp_buf, sizeof resp_buf, "ERROR: %s %s: %s\n", name, arg, strerror(-sc));
+  } else {
+    snprintf(resp_buf, sizeof resp_buf, "OK: %s %s\n", name, arg);
+  }
+}
+
+
+/* @brief   Discard ranges of the unit that no longer hold live data
+ *
+ * Takes up to DISCARD_MAX_RANGES pairs of byte offset and size within the
+ * unit. Each range is shrunk to whole BUF_SZ chunks of the card, partial
+ * chunks at either end are left alone. The ranges are sorted and adjacent or
+ * overlapping ranges are coalesced so that the card erases as few, large
+ * ranges as possible.
+ */
+void cmd_discard(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  struct discard_range ranges[DISCARD_MAX_RANGES];
+  char *arg;
+  off64_t offset;
+  off64_t end;
+  block64_t nblocks;
+  int nranges;
+  int ncommands;
+
+  if (bdev->discard == NULL) {
+    strlcpy(resp_buf, "ERROR: discard not supported\n", sizeof resp_buf);
+    return;
+  }
+
+  nranges = 0;
+
+  while ((arg = strtok(NULL, " ")) != NULL) {
+    if (nranges == DISCARD_MAX_RANGES) {
+      strlcpy(resp_buf, "ERROR: too many ranges\n", sizeof resp_buf);
+      return;
+    }
+
+    offset = strtoull(arg, NULL, 0);
+
+    if ((arg = strtok(NULL, " ")) == NULL) {
+      strlcpy(resp_buf, "ERROR: missing size\n", sizeof resp_buf);
+      return;
+    }
+
+    end = MIN(offset + (off64_t)strtoull(arg, NULL, 0), unit->size);
+
+    // Chunks are aligned to the card, not to the start of the unit
+    offset = roundup((off64_t)unit->start * 512 + offset, BUF_SZ);
+    end = rounddown((off64_t)unit->start * 512 + end, BUF_SZ);
+
+    if (end > offset) {
+      ranges[nranges].block_no = offset / 512;
+      ranges[nranges].nblocks = (end - offset) / 512;
+      nranges++;
+    }
+  }
+
+  qsort(ranges, nranges, sizeof (struct discard_range), discard_range_cmp);
+
+  nblocks = 0;
+  ncommands = 0;
+
+  for (int t = 0; t < nranges; ) {
+    block64_t start = ranges[t].block_no;
+    block64_t range_end = start + ranges[t].nblocks;
+
+    for (t++; t < nranges && ranges[t].block_no <= range_end; t++) {
+      range_end = MAX(range_end, ranges[t].block_no + ranges[t].nblocks);
+    }
+
+    discard_cache_blocks(start, range_end - start);
+
+    if (bdev->discard(bdev, start, range_end - start) != 0) {
+      strlcpy(resp_buf, "ERROR: discard failed\n", sizeof resp_buf);
+      return;
+    }
+
+    profiling_count(discard);
+    nblocks += range_end - start;
+    ncommands++;
+  }
+
+  snprintf(resp_buf, sizeof resp_buf, "OK: discarded %u blocks in %d ranges\n",
+           (uint32_t)nblocks, ncommands);
+}
+
+
+/*
+ *
+ */
+static int discard_range_cmp(const void *a, const void *b)
+{
+  const struct discard_range *ra = a;
+  const struct discard_range *rb = b;
+
+  if (ra->block_no < rb->block_no) {
+    return -1;
+  } else if (ra->block_no > rb->block_no) {
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* @brief   SIGTERM handler
+ *
+ * Dirty blocks are flushed by main() once it leaves its loop rather than
+ * here, as the signal may arrive in the middle of a card command.
+ */
 void sigterm_handler(int signo)
 {
   shutdown = true;
@@ -22,16 +22,141 @@
 #include "sdcard.h"
 #include <sys/debug.h>
 #include "mmio.h"
+#include "globals.h"
 #include <stdint.h>
+#include <string.h>
 #include <machine/cheviot_hal.h>
 
 inline void mmio_write(uint32_t reg, uint32_t data)
 {
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    emmc_sim_write(reg - emmc_base, data);
+    return;
+  }
+#endif
+
   hal_mmio_write((void *)reg, data);
 }
 
 inline uint32_t mmio_read(uint32_t reg)
 {
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    return emmc_sim_read(reg - emmc_base);
+  }
+#endif
+
   return hal_mmio_read((void *)reg);
 }
 
+
+
+/* @brief   Read a block of words from a data port register
+ *
+ * @param   reg, address of the data port, such as EMMC_DATA
+ * @param   buf, buffer to read into, need not be word aligned
+ * @param   len, number of bytes to read, a multiple of 4
+ *
+ * The port is read through a volatile pointer 8 words at a time so that the
+ * compiler can use multi-register stores into the buffer. Barriers are
+ * issued once before and after the block rather than per word as with
+ * mmio_read().
+ * An unaligned buffer is filled through a word aligned bounce of 8 words.
+ */
+void mmio_read_burst(uint32_t reg, void *buf, size_t len)
+{
+  volatile uint32_t *port = (volatile uint32_t *)reg;
+  uint32_t *dst = buf;
+  uint32_t w[8];
+  size_t t;
+
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    for (t = 0; t < len; t += 4) {
+      w[0] = emmc_sim_read(reg - emmc_base);
+      memcpy((uint8_t *)buf + t, &w[0], 4);
+    }
+    return;
+  }
+#endif
+
+  hal_dsb();
+
+  if (((uintptr_t)buf & 3) == 0) {
+    for (t = 0; t + 32 <= len; t += 32) {
+      w[0] = *port; w[1] = *port; w[2] = *port; w[3] = *port;
+      w[4] = *port; w[5] = *port; w[6] = *port; w[7] = *port;
+      dst[0] = w[0]; dst[1] = w[1]; dst[2] = w[2]; dst[3] = w[3];
+      dst[4] = w[4]; dst[5] = w[5]; dst[6] = w[6]; dst[7] = w[7];
+      dst += 8;
+    }
+  } else {
+    for (t = 0; t + 32 <= len; t += 32) {
+      w[0] = *port; w[1] = *port; w[2] = *port; w[3] = *port;
+      w[4] = *port; w[5] = *port; w[6] = *port; w[7] = *port;
+      memcpy((uint8_t *)buf + t, w, sizeof w);
+    }
+  }
+
+  // Remainder of short register-sized reads such as the SCR
+  for (; t < len; t += 4) {
+    w[0] = *port;
+    memcpy((uint8_t *)buf + t, &w[0], 4);
+  }
+
+  hal_dsb();
+}
+
+
+/* @brief   Write a block of words to a data port register
+ *
+ * @param   reg, address of the data port, such as EMMC_DATA
+ * @param   buf, buffer to write from, need not be word aligned
+ * @param   len, number of bytes to write, a multiple of 4
+ *
+ * The counterpart of mmio_read_burst(), the buffer is loaded 8 words at a
+ * time and written to the port with barriers only around the block.
+ */
+void mmio_write_burst(uint32_t reg, const void *buf, size_t len)
+{
+  volatile uint32_t *port = (volatile uint32_t *)reg;
+  const uint32_t *src = buf;
+  uint32_t w[8];
+  size_t t;
+
+#ifdef EMMC_SIMULATOR
+  if (config.sim_path[0] != '\0') {
+    for (t = 0; t < len; t += 4) {
+      memcpy(&w[0], (const uint8_t *)buf + t, 4);
+      emmc_sim_write(reg - emmc_base, w[0]);
+    }
+    return;
+  }
+#endif
+
+  hal_dsb();
+
+  if (((uintptr_t)buf & 3) == 0) {
+    for (t = 0; t + 32 <= len; t += 32) {
+      w[0] = src[0]; w[1] = src[1]; w[2] = src[2]; w[3] = src[3];
+      w[4] = src[4]; w[5] = src[5]; w[6] = src[6]; w[7] = src[7];
+      *port = w[0]; *port = w[1]; *port = w[2]; *port = w[3];
+      *port = w[4]; *port = w[5]; *port = w[6]; *port = w[7];
+      src += 8;
+    }
+  } else {
+    for (t = 0; t + 32 <= len; t += 32) {
+      memcpy(w, (const uint8_t *)buf + t, sizeof w);
+      *port = w[0]; *port = w[1]; *port = w[2]; *port = w[3];
+      *port = w[4]; *port = w[5]; *port = w[6]; *port = w[7];
+    }
+  }
+
+  for (; t < len; t += 4) {
+    memcpy(&w[0], (const uint8_t *)buf + t, 4);
+    *port = w[0];
+  }
+
+  hal_dsb();
+}
@@ -22,10 +22,13 @@
 #ifndef MMIO_H
 #define MMIO_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "sdcard.h"
 
 void mmio_write(uint32_t reg, uint32_t data);
 uint32_t mmio_read(uint32_t reg);
+void mmio_read_burst(uint32_t reg, void *buf, size_t len);
+void mmio_write_burst(uint32_t reg, const void *buf, size_t len);
 
 #endif // !MMIO_H
@@ -18,6 +18,7 @@
 #include <sys/event.h>
 #include "sdcard.h"
 #include "globals.h"
+#include "timer.h"
 #include <sys/rpi_mailbox.h>
 #include <sys/rpi_gpio.h>
 #include <sys/profiling.h>
@@ -26,6 +27,24 @@
 #include <sys/param.h>
 
 
+static void latency_record(struct latency_histogram *hist, size_t sz, uint32_t latency);
+static uint32_t usec_between(struct timespec *from, struct timespec *to);
+static void latency_stats(char *dir, struct latency_histogram *hist);
+static uint32_t latency_percentile(struct latency_histogram *hist, uint32_t per_10000);
+static int latency_bucket(uint32_t usec);
+static uint32_t latency_bucket_limit(int b);
+static int latency_size_class(size_t sz);
+
+
+static char *unit_size_class_names[UNIT_SIZE_CLASSES] = {
+  "512", "1K", "2K", "4K", "8K", "16K", "32K", "64K", "128K", ">128K"
+};
+
+static char *latency_size_class_names[LATENCY_SIZE_CLASSES] = {
+  "<=4K", "<=32K", "<=128K", ">128K"
+};
+
+
 /*
  *
  */
@@ -46,6 +65,8 @@ void cmd_profiling(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
     cmd_profiling_disable(unit, msgid, req);
   } else if (strcmp("reset", cmd) == 0) {
     cmd_profiling_reset(unit, msgid, req);
+  } else if (strcmp("unit", cmd) == 0) {
+    cmd_profiling_unit(unit, msgid, req);
   } else {
     strlcpy(resp_buf, "ERROR: unknown subcommand\n", sizeof resp_buf);
   } 
@@ -57,13 +78,19 @@ void cmd_profiling(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
  */
 void cmd_profiling_stats(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
 {
-  char tmp[32];
+  char tmp[128];
     
   snprintf(resp_buf, sizeof resp_buf, "OK: stats\n"
             "reads: %d\n"
             "writes: %d\n"
             "read time  avg:%d, min: %d, max: %d (us)\n"
-            "write time avg:%d, min: %d, max: %d (us)\n",
+            "write time avg:%d, min: %d, max: %d (us)\n"
+            "cache hits: %d, misses: %d, evictions: %d\n"
+            "read-ahead commands: %d\n"
+            "direct reads: %d\n"
+            "write-back commands: %d\n"
+            "merged requests: %d\n"
+            "discard commands: %d\n",
             profiling_count_get(read),
             profiling_count_get(write),
             profiling_ts_avg(read),
@@ -71,8 +98,29 @@ void cmd_profiling_stats(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req
             profiling_ts_max(read),
             profiling_ts_avg(write),
             profiling_ts_min(write),
-            profiling_ts_max(write)
+            profiling_ts_max(write),
+            profiling_count_get(cache_hit),
+            profiling_count_get(cache_miss),
+            profiling_count_get(cache_evict),
+            profiling_count_get(readahead),
+            profiling_count_get(direct_read),
+            profiling_count_get(writeback),
+            profiling_count_get(ioq_merge),
+            profiling_count_get(discard)
             );            
+
+  strlcat(resp_buf, "latency (us):\n", sizeof resp_buf);
+  latency_stats("read", read_latency);
+  latency_stats("write", write_latency);
+
+  strlcat(resp_buf, "waits:\n", sizeof resp_buf);
+
+  for (int t = 0; spin_waits[t] != NULL; t++) {
+    snprintf(tmp, sizeof tmp, "%-8s spin: %u, sleep: %u, timeout: %u, avg: %u us, budget: %u us\n",
+             spin_waits[t]->name, spin_waits[t]->spin_done, spin_waits[t]->sleep_done,
+             spin_waits[t]->timeouts, spin_waits[t]->avg_usec, spin_waits[t]->spin_usec);
+    strlcat(resp_buf, tmp, sizeof resp_buf);
+  }
 }
 
 
@@ -103,11 +151,295 @@ void cmd_profiling_reset(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req
 {
   profiling_count_reset(read);
   profiling_count_reset(write);
+  profiling_count_reset(cache_hit);
+  profiling_count_reset(cache_miss);
+  profiling_count_reset(cache_evict);
+  profiling_count_reset(readahead);
+  profiling_count_reset(direct_read);
+  profiling_count_reset(writeback);
+  profiling_count_reset(ioq_merge);
+  profiling_count_reset(discard);
 
   profiling_ts_reset(read);
   profiling_ts_reset(write);
 
+  memset(read_latency, 0, sizeof read_latency);
+  memset(write_latency, 0, sizeof write_latency);
+
+  for (int t = 0; t < nunits; t++) {
+    reset_unit_stats(&unit[t]);
+  }
+
+  for (int t = 0; spin_waits[t] != NULL; t++) {
+    spin_wait_reset(spin_waits[t]);
+  }
+
   strlcpy(resp_buf, "OK: reset\n", sizeof resp_buf);
 }
 
 
+/* @brief   Report the I/O accounting of the unit the command was sent to
+ *
+ * Rates and utilization are averaged over the time since the stats were
+ * last reset. Queue depth is the number of reads and writes, to any unit,
+ * already waiting in the request queue when each request to this unit
+ * arrived, queue wait the time from its arrival until it was serviced.
+ */
+void cmd_profiling_unit(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req)
+{
+  struct unit_stats *stats = &unit->stats;
+  struct timespec now;
+  char line[64];
+  uint64_t elapsed_msec;
+  uint32_t nreqs;
+  uint32_t nlookups;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  elapsed_msec = (uint64_t)(now.tv_sec - stats->start_ts.tv_sec) * 1000
+                 + (now.tv_nsec - stats->start_ts.tv_nsec) / 1000000;
+  elapsed_msec = MAX(elapsed_msec, 1);
+
+  nreqs = MAX(stats->reads + stats->writes, 1);
+  nlookups = MAX(stats->cache_hits + stats->cache_misses, 1);
+
+  snprintf(resp_buf, sizeof resp_buf, "OK: unit %s\n"
+            "reads: %u, bytes: %llu\n"
+            "writes: %u, bytes: %llu\n"
+            "iops: %u, read: %u KB/s, write: %u KB/s\n"
+            "sequential: %u%%\n"
+            "cache hit rate: %u%%, direct reads: %u\n"
+            "queue depth avg: %u.%02u, max: %u\n"
+            "queue wait avg: %u us\n"
+            "utilization: %u%%\n"
+            "sizes:",
+            unit->path,
+            stats->reads, (unsigned long long)stats->bytes_read,
+            stats->writes, (unsigned long long)stats->bytes_written,
+            (uint32_t)((uint64_t)(stats->reads + stats->writes) * 1000 / elapsed_msec),
+            (uint32_t)(stats->bytes_read * 1000 / 1024 / elapsed_msec),
+            (uint32_t)(stats->bytes_written * 1000 / 1024 / elapsed_msec),
+            (uint32_t)((uint64_t)stats->sequential * 100 / nreqs),
+            (uint32_t)((uint64_t)stats->cache_hits * 100 / nlookups),
+            stats->direct_reads,
+            stats->queue_depth_sum / nreqs,
+            (uint32_t)((uint64_t)(stats->queue_depth_sum % nreqs) * 100 / nreqs),
+            stats->queue_depth_max,
+            (uint32_t)(stats->wait_usec / nreqs),
+            (uint32_t)(MIN(stats->busy_usec / 1000, elapsed_msec) * 100 / elapsed_msec));
+
+  for (int t = 0; t < UNIT_SIZE_CLASSES; t++) {
+    if (stats->sizes[t] != 0) {
+      snprintf(line, sizeof line, " %s:%u", unit_size_class_names[t], stats->sizes[t]);
+      strlcat(resp_buf, line, sizeof resp_buf);
+    }
+  }
+
+  strlcat(resp_buf, "\n", sizeof resp_buf);
+}
+
+
+/* @brief   Account for a completed read or write
+ *
+ * @param   unit, the unit the request was sent to
+ * @param   write, true for a write, false for a read
+ * @param   offset, offset of the request within the unit
+ * @param   sz, size of the request in bytes
+ * @param   arrival_ts, time queue_messages() received the request
+ * @param   start_ts, time the request started being serviced
+ *
+ * Records the latency seen by the client, from arrival to completion, in
+ * the global histograms. The unit's busy time counts only the service
+ * time, the time spent waiting in the request queue is kept separately.
+ * Cache hits and queue depth are counted where they occur.
+ */
+void account_request(struct bdev_unit *unit, bool write, off64_t offset, size_t sz,
+                     struct timespec *arrival_ts, struct timespec *start_ts)
+{
+  struct unit_stats *stats = &unit->stats;
+  struct timespec now;
+  uint32_t usec;
+  int size_class;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  latency_record(write ? write_latency : read_latency, sz, usec_between(arrival_ts, &now));
+  usec = usec_between(start_ts, &now);
+  stats->wait_usec += usec_between(arrival_ts, start_ts);
+
+  if (write) {
+    stats->writes++;
+    stats->bytes_written += sz;
+  } else {
+    stats->reads++;
+    stats->bytes_read += sz;
+  }
+
+  if (offset == stats->next_offset) {
+    stats->sequential++;
+  }
+
+  stats->next_offset = offset + sz;
+  stats->busy_usec += usec;
+
+  size_class = 0;
+  while (size_class < UNIT_SIZE_CLASSES - 1 && sz > (512u << size_class)) {
+    size_class++;
+  }
+
+  stats->sizes[size_class]++;
+}
+
+
+/* @brief   Clear the I/O accounting of a unit
+ *
+ */
+void reset_unit_stats(struct bdev_unit *unit)
+{
+  memset(&unit->stats, 0, sizeof unit->stats);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &unit->stats.start_ts);
+}
+
+
+/* @brief   Add the latency of a completed read or write to a histogram
+ *
+ * @param   hist, read_latency or write_latency
+ * @param   sz, size of the request in bytes, selects the size class
+ * @param   latency, the latency in us
+ */
+static void latency_record(struct latency_histogram *hist, size_t sz, uint32_t latency)
+{
+  hist = &hist[latency_size_class(sz)];
+  hist->buckets[latency_bucket(latency)]++;
+  hist->count++;
+
+  if (latency > hist->max) {
+    hist->max = latency;
+  }
+}
+
+
+/* @brief   Get the time between two timestamps in us, saturating
+ *
+ */
+static uint32_t usec_between(struct timespec *from, struct timespec *to)
+{
+  uint64_t usec;
+
+  usec = (uint64_t)(to->tv_sec - from->tv_sec) * 1000000
+         + (to->tv_nsec - from->tv_nsec) / 1000;
+
+  return (usec > UINT32_MAX) ? UINT32_MAX : usec;
+}
+
+
+/* @brief   Append percentiles of each size class of a histogram to resp_buf
+ *
+ * @param   dir, "read" or "write"
+ * @param   hist, array of histograms indexed by size class
+ *
+ * The percentiles are the upper limits of the buckets they fall in, so
+ * are at most 25% above the actual latency.
+ */
+static void latency_stats(char *dir, struct latency_histogram *hist)
+{
+  char line[128];
+
+  for (int t = 0; t < LATENCY_SIZE_CLASSES; t++) {
+    if (hist[t].count == 0) {
+      continue;
+    }
+
+    snprintf(line, sizeof line, "%-5s %-6s n: %u, p50: %u, p90: %u, p99: %u, p99.9: %u, max: %u\n",
+             dir, latency_size_class_names[t], hist[t].count,
+             latency_percentile(&hist[t], 5000),
+             latency_percentile(&hist[t], 9000),
+             latency_percentile(&hist[t], 9900),
+             latency_percentile(&hist[t], 9990),
+             hist[t].max);
+
+    strlcat(resp_buf, line, sizeof resp_buf);
+  }
+}
+
+
+/* @brief   Estimate a percentile of a histogram
+ *
+ * @param   hist, histogram of a single size class
+ * @param   per_10000, the percentile in hundredths of a percent
+ * @return  latency in us below which the percentile of requests completed
+ */
+static uint32_t latency_percentile(struct latency_histogram *hist, uint32_t per_10000)
+{
+  uint64_t rank;
+  uint64_t total;
+
+  rank = ((uint64_t)hist->count * per_10000 + 9999) / 10000;
+  total = 0;
+
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    total += hist->buckets[b];
+
+    if (total >= rank) {
+      return MIN(latency_bucket_limit(b), hist->max);
+    }
+  }
+
+  return hist->max;
+}
+
+
+/* @brief   Get the histogram bucket of a latency
+ *
+ * Latencies below LATENCY_SUB_BUCKETS us have a bucket each. Above that
+ * each power of 2 is split into LATENCY_SUB_BUCKETS linear buckets.
+ */
+static int latency_bucket(uint32_t usec)
+{
+  int msb;
+
+  if (usec < LATENCY_SUB_BUCKETS) {
+    return usec;
+  }
+
+  msb = 31 - __builtin_clz(usec);
+
+  return (msb - 1) * LATENCY_SUB_BUCKETS + ((usec >> (msb - 2)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+
+/* @brief   Get the largest latency that falls in a histogram bucket
+ *
+ */
+static uint32_t latency_bucket_limit(int b)
+{
+  int msb;
+  uint64_t lower;
+
+  if (b < LATENCY_SUB_BUCKETS) {
+    return b;
+  }
+
+  msb = b / LATENCY_SUB_BUCKETS + 1;
+  lower = (uint64_t)(LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS) << (msb - 2);
+
+  return MIN(lower + (1ULL << (msb - 2)) - 1, UINT32_MAX);
+}
+
+
+/*
+ *
+ */
+static int latency_size_class(size_t sz)
+{
+  if (sz <= 4096) {
+    return 0;
+  } else if (sz <= 32768) {
+    return 1;
+  } else if (sz <= 131072) {
+    return 2;
+  }
+
+  return 3;
+}
+
@@ -0,0 +1,328 @@
+#define LOG_LEVEL_WARN
+
+#include "sys/debug.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscalls.h>
+#include <sys/param.h>
+#include <sys/profiling.h>
+#include <time.h>
+#include "sdcard.h"
+#include "globals.h"
+
+
+static void dispatch_read_run(struct io_request **run, int n);
+static void dispatch_write_run(struct io_request **run, int n);
+static bool can_merge_writes(struct io_request *a, struct io_request *b, size_t run_sz);
+static int io_request_cmp(const void *a, const void *b);
+
+
+/* @brief   Move pending messages of a unit's port into the request queue
+ *
+ * @param   unit, the unit whose message port is drained
+ * @return  0 if the port is empty, 1 if the queue is full, -1 on error
+ *
+ * Reads and writes are queued to be sorted by dispatch_queue(). Other
+ * commands such as sendio do not access the card in a way that benefits
+ * from ordering and are handled immediately.
+ */
+int queue_messages(struct bdev_unit *unit)
+{
+  struct io_request *ioreq;
+  int sc;
+
+  while (ioq.count < IO_QUEUE_SZ) {
+    ioreq = &ioq.requests[ioq.count];
+
+    sc = getmsg(unit->portid, &ioreq->msgid, &ioreq->req, sizeof ioreq->req);
+
+    if (sc == 0) {
+      return 0;
+    } else if (sc != sizeof ioreq->req) {
+      log_error("sdcard: getmsg sc=%d %s", sc, strerror(errno));
+      return -1;
+    }
+
+    switch (ioreq->req.cmd) {
+      case CMD_READ:
+        ioreq->offset = (off64_t)unit->start * 512 + ioreq->req.args.read.offset;
+        ioreq->sz = ioreq->req.args.read.sz;
+        break;
+
+      case CMD_WRITE:
+        ioreq->offset = (off64_t)unit->start * 512 + ioreq->req.args.write.offset;
+        ioreq->sz = ioreq->req.args.write.sz;
+        break;
+
+      case CMD_SENDIO:
+        sdcard_sendio(unit, ioreq->msgid, &ioreq->req);
+        continue;
+
+      default:
+        log_warn("sdcard: unknown command: %d", ioreq->req.cmd);
+        replymsg(unit->portid, ioreq->msgid, -ENOTSUP, NULL, 0);
+        continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ioreq->arrival_ts);
+    unit->stats.queue_depth_sum += ioq.count;
+    unit->stats.queue_depth_max = MAX(unit->stats.queue_depth_max, ioq.count);
+
+    ioreq->unit = unit;
+    ioreq->seq = ioq.seq++;
+    ioq.count++;
+  }
+
+  return 1;
+}
+
+
+/* @brief   Service all queued requests in C-LOOK elevator order
+ *
+ * Requests are sorted by absolute offset on the card, regardless of the
+ * unit they were sent to. Servicing starts at the first request at or
+ * beyond the end of the previously serviced request and proceeds upwards,
+ * then wraps around to the lowest offset, so the card sees ascending
+ * addresses for as long as possible.
+ *
+ * Requests with the same offset keep their order of arrival. Requests that
+ * overlap but start at different offsets may be reordered, they must have
+ * come from different clients as each client waits for its reply.
+ *
+ * Adjacent reads are merged into a single read into the cache of up to the
+ * size prefetch_cache_blocks() reads at once, reads large enough to bypass
+ * the cache are serviced on their own. Adjacent block aligned writes are
+ * merged into a single multi-block write when in write-through mode, in
+ * write-back mode the cache coalesces them.
+ */
+void dispatch_queue(void)
+{
+  struct io_request **sorted;
+  struct io_request **run;
+  int start;
+  int n;
+
+  if (ioq.count == 0) {
+    return;
+  }
+
+  sorted = ioq.sorted;
+
+  for (int t = 0; t < ioq.count; t++) {
+    sorted[t] = &ioq.requests[t];
+  }
+
+  qsort(sorted, ioq.count, sizeof (struct io_request *), io_request_cmp);
+
+  start = 0;
+  while (start < ioq.count && sorted[start]->offset < ioq.head_offset) {
+    start++;
+  }
+
+  // Rotate so that the requests below the head are serviced last
+  struct io_request *elevator[ioq.count];
+
+  for (int t = 0; t < ioq.count; t++) {
+    elevator[t] = sorted[(start + t) % ioq.count];
+  }
+
+  for (int t = 0; t < ioq.count; t += n) {
+    run = &elevator[t];
+    n = 1;
+
+    if (run[0]->req.cmd == CMD_READ && is_direct_read(&run[0]->req)) {
+      sdcard_read(run[0]->unit, run[0]->msgid, &run[0]->req, &run[0]->arrival_ts);
+    } else if (run[0]->req.cmd == CMD_READ) {
+      off64_t run_start = rounddown(run[0]->offset, BUF_SZ);
+      off64_t run_end = run[0]->offset + run[0]->sz;
+      off64_t max_run_sz = MIN(config.xfer_size, (cache.nentries / 2) * BUF_SZ);
+
+      // A run larger than prefetch_cache_blocks() reads at a time would
+      // evict its own leading chunks before they are replied to
+      while (t + n < ioq.count && run[n]->req.cmd == CMD_READ
+             && !is_direct_read(&run[n]->req) && run[n]->offset <= run_end
+             && roundup(MAX(run_end, run[n]->offset + run[n]->sz), BUF_SZ) - run_start
+                <= max_run_sz) {
+        run_end = MAX(run_end, run[n]->offset + run[n]->sz);
+        n++;
+      }
+
+      dispatch_read_run(run, n);
+    } else {
+      size_t run_sz = run[0]->sz;
+
+      while (t + n < ioq.count && can_merge_writes(run[n - 1], run[n], run_sz)) {
+        run_sz += run[n]->sz;
+        n++;
+      }
+
+      dispatch_write_run(run, n);
+    }
+
+    ioq.head_offset = run[n - 1]->offset + run[n - 1]->sz;
+  }
+
+  ioq.count = 0;
+}
+
+
+/* @brief   Fail all queued requests without servicing them
+ *
+ * @param   error, negative errno to reply with
+ *
+ * Used when the driver must stop receiving messages, so that clients
+ * waiting on queued requests are not left blocked.
+ */
+void abort_queue(int error)
+{
+  for (int t = 0; t < ioq.count; t++) {
+    replymsg(ioq.requests[t].unit->portid, ioq.requests[t].msgid, error, NULL, 0);
+  }
+
+  ioq.count = 0;
+}
+
+
+/* @brief   Service a run of overlapping or adjacent reads
+ *
+ * @param   run, array of read requests sorted by offset
+ * @param   n, number of requests in the run
+ *
+ * The whole range covered by the run is read into the cache with as few
+ * multi-block reads as possible, each request is then replied to from
+ * the cache.
+ */
+static void dispatch_read_run(struct io_request **run, int n)
+{
+  off64_t start;
+  off64_t end;
+
+  if (n > 1) {
+    start = rounddown(run[0]->offset, BUF_SZ);
+    end = run[0]->offset + run[0]->sz;
+
+    for (int t = 1; t < n; t++) {
+      end = MAX(end, run[t]->offset + run[t]->sz);
+    }
+
+    end = roundup(end, BUF_SZ);
+
+    for (int t = 1; t < n; t++) {
+      profiling_count(ioq_merge);
+    }
+
+    // On failure each read retries its own blocks and reports the error
+    prefetch_cache_blocks(start / 512, (end - start) / BUF_SZ);
+  }
+
+  for (int t = 0; t < n; t++) {
+    sdcard_read(run[t]->unit, run[t]->msgid, &run[t]->req, &run[t]->arrival_ts);
+  }
+}
+
+
+/* @brief   Service a run of adjacent writes
+ *
+ * @param   run, array of write requests sorted by offset
+ * @param   n, number of requests in the run
+ *
+ * A run of more than one request has been checked by can_merge_writes()
+ * and is written with a single multi-block write from xfer_buf.
+ */
+static void dispatch_write_run(struct io_request **run, int n)
+{
+  size_t xfered;
+  struct timespec start_ts;
+  int sc;
+
+  if (n == 1) {
+    sdcard_write(run[0]->unit, run[0]->msgid, &run[0]->req, &run[0]->arrival_ts);
+    return;
+  }
+
+  profiling_begin(write);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+
+  xfered = 0;
+
+  for (int t = 0; t < n; t++) {
+    readmsg(run[t]->unit->portid, run[t]->msgid, xfer_buf + xfered, run[t]->sz, 0);
+    xfered += run[t]->sz;
+  }
+
+  sc = bdev->write(bdev, xfer_buf, xfered, run[0]->offset / 512);
+
+  if (sc >= 0) {
+    update_cache_blocks(run[0]->offset / 512, xfer_buf, xfered);
+  }
+
+  for (int t = 0; t < n; t++) {
+    replymsg(run[t]->unit->portid, run[t]->msgid, (sc >= 0) ? (int)run[t]->sz : -EIO, NULL, 0);
+    account_request(run[t]->unit, true, run[t]->req.args.write.offset, run[t]->sz,
+                    &run[t]->arrival_ts, &start_ts);
+    profiling_count(write);
+
+    if (t > 0) {
+      profiling_count(ioq_merge);
+    }
+  }
+
+  profiling_end_usec(write);
+}
+
+
+/* @brief   Check if a write can be merged with the preceding write
+ *
+ * @param   a, the last write in the run
+ * @param   b, the write to add to the run
+ * @param   run_sz, size of the run so far in bytes
+ * @return  true if b can be written in the same command as the run
+ *
+ * Only block aligned writes that are exactly adjacent and within the same
+ * allocation unit are merged, and only in write-through mode, as in
+ * write-back mode the data goes to the cache and flush_cache() coalesces
+ * it.
+ */
+static bool can_merge_writes(struct io_request *a, struct io_request *b, size_t run_sz)
+{
+  if (config.writeback_delay > 0 || b->req.cmd != CMD_WRITE) {
+    return false;
+  }
+
+  if (a->offset % 512 != 0 || a->sz % 512 != 0 || b->sz % 512 != 0) {
+    return false;
+  }
+
+  if (b->offset != a->offset + a->sz) {
+    return false;
+  }
+
+  if (au_limit(b->offset - run_sz, run_sz + b->sz) != run_sz + b->sz) {
+    return false;
+  }
+
+  return (run_sz + b->sz <= config.xfer_size);
+}
+
+
+/*
+ *
+ */
+static int io_request_cmp(const void *a, const void *b)
+{
+  const struct io_request *ra = *(struct io_request * const *)a;
+  const struct io_request *rb = *(struct io_request * const *)b;
+
+  if (ra->offset < rb->offset) {
+    return -1;
+  } else if (ra->offset > rb->offset) {
+    return 1;
+  }
+
+  return ra->seq - rb->seq;
+}
+
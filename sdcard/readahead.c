@@ -0,0 +1,83 @@
+#define LOG_LEVEL_WARN
+
+#include "sys/debug.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscalls.h>
+#include <sys/param.h>
+#include "sdcard.h"
+#include "globals.h"
+
+
+/* @brief   Detect sequential streams and read ahead of them
+ *
+ * @param   unit, the unit being read
+ * @param   offset, offset of the read within the unit
+ * @param   sz, size of the read in bytes
+ *
+ * A read that starts where the previous read on the unit ended continues
+ * a stream and doubles the read-ahead window, up to config.readahead_max.
+ * Any other read ends the stream.
+ *
+ * Read-ahead is issued a whole window at a time, once the reader gets
+ * within half a window of the end of the last read-ahead. This keeps the
+ * number of commands per stream low instead of topping up by one chunk
+ * on every request. The window is limited to half of the cache so that
+ * read-ahead does not evict the blocks it has just read.
+ */
+void sdcard_readahead(struct bdev_unit *unit, off64_t offset, size_t sz)
+{
+  off64_t start;
+  off64_t end;
+  off64_t unit_end;
+  size_t max_window;
+
+  if (config.readahead_max == 0 || sz == 0) {
+    return;
+  }
+
+  if (offset != unit->ra_next_offset || offset == 0) {
+    unit->ra_next_offset = offset + sz;
+    unit->ra_end = 0;
+    unit->ra_window = 0;
+    return;
+  }
+
+  unit->ra_next_offset = offset + sz;
+
+  max_window = MIN(config.readahead_max, (cache.nentries / 2) * BUF_SZ);
+
+  if (unit->ra_window == 0) {
+    unit->ra_window = MIN(READAHEAD_MIN, max_window);
+  } else {
+    unit->ra_window = MIN(unit->ra_window * 2, max_window);
+  }
+
+  if (offset + sz + unit->ra_window / 2 <= unit->ra_end) {
+    return;
+  }
+
+  start = MAX(offset, unit->ra_end);
+  end = offset + sz + unit->ra_window;
+  unit_end = unit->size;
+
+  if (end > unit_end) {
+    end = unit_end;
+  }
+
+  unit->ra_end = end;
+
+  start = rounddown((off64_t)unit->start * 512 + start, BUF_SZ);
+  end = roundup((off64_t)unit->start * 512 + end, BUF_SZ);
+
+  if (end <= start) {
+    return;
+  }
+
+  prefetch_cache_blocks(start / 512, (end - start) / BUF_SZ);
+}
+
@@ -22,23 +22,70 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/iorequest.h>
 #include <sys/syslimits.h>
 #include <sys/syscalls.h>
+#include <time.h>
 
 
 // Constants
 #define SDCARD_TASK_PRIORITY  28        // Use SCHED_RR
 #define MMAP_START_BASE       0x60000000
 #define BUF_SZ    			      4096      // Buffer size used to read and write
+#define CACHE_BLOCK_NBLOCKS   (BUF_SZ / 512)  // Number of 512 byte blocks in each cache entry
+#define CACHE_BLOCKS_DEFAULT  64        // Default number of BUF_SZ entries in block cache
+#define READAHEAD_MAX_DEFAULT (128 * 1024)  // Default maximum read-ahead window
+#define READAHEAD_MIN         (4 * BUF_SZ)  // Initial read-ahead window of a stream
+#define XFER_SZ_DEFAULT       (128 * 1024)  // Default size of multi-block transfers
+#define XFER_SZ_MAX           (16 * 1024 * 1024)  // Largest transfer, within the 16-bit block count
+#define DIRECT_READ_DEFAULT   (64 * 1024)   // Default size from which reads bypass the cache
+#define WRITEBACK_WATERMARK   75            // Percentage of cache dirty that forces a flush
+#define IO_QUEUE_SZ           32            // Maximum reads and writes sorted at a time
+#define INIT_PHASES_MAX       24            // Initialization phases timed for debug init
+#define DISCARD_MAX_RANGES    16            // Ranges accepted by a single discard command
+#define HOT_LIST_SZ           (2 * BUF_SZ)  // Size of the hot-block list on the card
+#define HOT_LIST_MAGIC        0x31424c48    // "HLB1"
+#define HOT_EXTENTS_MAX       (HOT_LIST_SZ / 8 - 1)  // Extents in a hot-block list
+#define HOT_RECORD_SECS_DEFAULT 30          // Default time hot blocks are recorded after start
+#define LATENCY_SUB_BUCKETS   4             // Latency histogram buckets per power of 2
+#define LATENCY_BUCKETS       128           // Latency histogram buckets, up to 2^32 us
+#define LATENCY_SIZE_CLASSES  4             // Request size classes with their own histogram
+#define UNIT_SIZE_CLASSES     10            // Per-unit request sizes, 512 bytes to >128K
+
+// #define EMMC_SIMULATOR                   // Build the register level simulator, target only, see emmc_sim.c
+
+#define EVENT_EMMC_INT        1             // Event bit to set on an interrupt occuring
+#define EMMC_IRPT_ERROR_MASK  0xffff0000    // Error interrupt bits of EMMC_INTERRUPT
 
 #define EMMC_REGS_START_VADDR   (void *)0x60000000    // Map emmc regs above this address
 #define MBOX_REGS_START_VADDR   (void *)0x68000000    // Map mailbox regs above this address
 
 typedef uint64_t  block64_t;
 
+// @brief   I/O accounting of a unit since the stats were last reset
+struct unit_stats
+{
+  struct timespec start_ts;   // time the stats were reset
+  uint32_t reads;
+  uint32_t writes;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint32_t sequential;        // requests starting where the previous one ended
+  uint32_t cache_hits;        // BUF_SZ chunks of reads found in the cache
+  uint32_t cache_misses;
+  uint32_t direct_reads;      // reads that bypassed the cache
+  uint32_t queue_depth_sum;   // requests already queued when each one arrived
+  uint32_t queue_depth_max;
+  uint64_t busy_usec;         // total service time of requests to this unit
+  uint64_t wait_usec;         // total time requests waited in the request queue
+  uint32_t sizes[UNIT_SIZE_CLASSES];  // requests by size, powers of 2 from 512 bytes
+  off64_t next_offset;        // offset following the previous request, within unit
+};
+
+
 // @brief   structure representing a mount point, e.g. sda, sda1, sda2, sda3 or sda4
 struct bdev_unit
 {
@@ -50,6 +97,12 @@ struct bdev_unit
   block64_t start;            // start block
   off64_t size;               // size in bytes
   block64_t blocks;           // number of 512 byte blocks  
+
+  off64_t ra_next_offset;     // offset following the last read, within unit
+  off64_t ra_end;             // offset up to which read-ahead was issued
+  size_t ra_window;           // read-ahead window, 0 if not a sequential stream
+
+  struct unit_stats stats;
 };
 
 
@@ -75,6 +128,119 @@ struct Config
   gid_t gid;  
   mode_t mode;
   dev_t dev;
+  int cache_blocks;           // number of BUF_SZ entries in the block cache
+  size_t readahead_max;       // maximum read-ahead window in bytes, 0 to disable
+  size_t xfer_size;           // largest multi-block transfer, multiple of BUF_SZ
+  size_t direct_read_min;     // reads of this size or larger bypass the cache, 0 to disable
+  int writeback_delay;        // max age of dirty blocks in ms, 0 for write-through
+  char image_path[PATH_MAX + 1];  // disk image to use instead of the sd card
+  char sim_path[PATH_MAX + 1];    // disk image of the simulated card, see emmc_sim.c
+  uint32_t model_latency;     // modelled latency per command in us
+  uint32_t model_bandwidth;   // modelled bandwidth of the image backend in KB/s, 0 unlimited
+  uint32_t model_busy;        // modelled busy time of the simulated card per write in us
+  bool fast_boot;             // poll for readiness rather than sleeping worst-case delays
+  block64_t hot_list_block;   // block of the hot-block list outside any partition, 0 to disable
+  uint32_t hot_record_secs;   // time reads are recorded in the hot-block list after start
+};
+
+
+// @brief   An entry in the block cache holding BUF_SZ bytes of the disk
+//
+// Entries are keyed on the absolute block number of the whole disk so that
+// they are shared by the whole-disk unit and the partition units.
+struct cache_block
+{
+  struct cache_block *hash_next;    // next entry in the same hash bucket
+  struct cache_block *lru_prev;     // more recently used entry
+  struct cache_block *lru_next;     // less recently used entry
+  block64_t block_no;               // first 512 byte block, aligned to BUF_SZ
+  uint8_t *data;                    // BUF_SZ bytes of cached data
+  bool valid;
+  bool dirty;                       // modified, not yet written to the card
+};
+
+
+// @brief   The block cache shared by all units
+struct block_cache
+{
+  struct cache_block *entries;      // array of nentries cache blocks
+  struct cache_block **hash;        // hash table of nbuckets chains
+  int nentries;
+  int nbuckets;
+  struct cache_block *lru_head;     // most recently used entry
+  struct cache_block *lru_tail;     // least recently used, next to be evicted
+  uint8_t *data;                    // nentries * BUF_SZ bytes of block data
+
+  int ndirty;                       // number of dirty entries
+  int writeback_errors;             // failed write-backs of dirty runs since start
+  struct timespec dirty_ts;         // time the oldest dirty entry was written
+  struct cache_block **flush_list;  // nentries pointers used to sort dirty entries
+};
+
+
+// @brief   Time taken by a phase of driver initialization
+struct init_phase
+{
+  char *name;
+  uint32_t usec;
+};
+
+
+// @brief   A range of 512 byte blocks to be discarded
+struct discard_range
+{
+  block64_t block_no;
+  block64_t nblocks;
+};
+
+
+// @brief   A range of BUF_SZ chunks read at boot, see hotlist.c
+struct hot_extent
+{
+  uint32_t block_no;                // first 512 byte block, aligned to BUF_SZ
+  uint32_t nchunks;
+};
+
+
+// @brief   The hot-block list as stored on the card, HOT_LIST_SZ bytes
+struct hot_list
+{
+  uint32_t magic;
+  uint32_t nextents;
+  struct hot_extent extents[HOT_EXTENTS_MAX];
+};
+
+
+// @brief   A read or write request waiting in the request queue
+struct io_request
+{
+  struct bdev_unit *unit;           // unit the request was sent to
+  msgid_t msgid;
+  iorequest_t req;
+  off64_t offset;                   // absolute byte offset on the card
+  size_t sz;
+  int seq;                          // order of arrival, keeps sort stable
+  struct timespec arrival_ts;       // time queue_messages() received it
+};
+
+
+// @brief   Queue of read and write requests sorted by the elevator
+struct io_queue
+{
+  struct io_request requests[IO_QUEUE_SZ];
+  struct io_request *sorted[IO_QUEUE_SZ];
+  int count;
+  int seq;
+  off64_t head_offset;              // offset following the last request serviced
+};
+
+
+// @brief   Log bucketed histogram of request latencies
+struct latency_histogram
+{
+  uint32_t count;
+  uint32_t max;                     // longest latency in us
+  uint32_t buckets[LATENCY_BUCKETS];
 };
 
 
@@ -93,32 +259,85 @@ struct block_device
               uint32_t block_num);
   int (*write)(struct block_device *dev, uint8_t *buf, size_t buf_size,
                uint32_t block_num);
+  int (*discard)(struct block_device *dev, uint32_t block_num, uint32_t nblocks);
 
   size_t block_size;    // used ?
   off64_t num_blocks;   // used ?
+  size_t au_size;       // allocation unit of the card in bytes, 0 if unknown
 };
 
 
+// cache.c
+int init_cache(int nentries);
+int resize_cache(int nentries);
+struct cache_block *get_cache_block(block64_t block_no);
+struct cache_block *find_cache_block(block64_t block_no);
+void update_cache_blocks(block64_t block_no, uint8_t *data, size_t sz);
+void copy_cached_blocks(block64_t block_no, uint8_t *data, size_t sz);
+void invalidate_cache(void);
+void discard_cache_blocks(block64_t block_no, block64_t nblocks);
+int prefetch_cache_blocks(block64_t block_no, int nchunks);
+struct cache_block *new_cache_block(block64_t block_no);
+void mark_cache_block_dirty(struct cache_block *cblk);
+int flush_cache(void);
+void writeback_cache(void);
+struct timespec *writeback_timeout(void);
+
 // emmc.c
 int sd_card_init(struct block_device **dev);
 int sd_read(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t block_no);
 int sd_write(struct block_device *dev, uint8_t *buf, size_t buf_size, uint32_t block_no);
 
+// queue.c
+int queue_messages(struct bdev_unit *unit);
+void dispatch_queue(void);
+void abort_queue(int error);
+
+// hotlist.c
+int init_hot_list(void);
+void record_hot_blocks(off64_t offset, size_t sz);
+int save_hot_list(void);
+void service_hot_list(void);
+struct timespec *hot_list_timeout(struct timespec *timeout);
+
+// readahead.c
+void sdcard_readahead(struct bdev_unit *unit, off64_t offset, size_t sz);
+
+// image.c
+int image_init(struct block_device **dev, char *path);
+
+// emmc_sim.c
+int emmc_sim_init(char *path);
+uint32_t emmc_sim_read(uint32_t reg);
+void emmc_sim_write(uint32_t reg, uint32_t data);
+
 // init.c
 void init(int argc, char *argv[]);
+int init_emmc(void);
 int process_args(int argc, char *argv[]);
 int enable_power_and_clocks(void);
 int map_io_registers(void);
 int get_fdt_device_info(void);
+int init_interrupts(void);
 int create_device_mount(void);
+blksize_t preferred_io_size(void);
+int alloc_xfer_buf(size_t xfer_size);
+void record_init_phase(char *name, struct timespec *phase_ts);
 int create_partition_mounts(void);
 
 // main.c
-void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
-void sdcard_write(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void sdcard_read(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req,
+                 struct timespec *arrival_ts);
+bool is_direct_read(iorequest_t *req);
+void sdcard_write(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req,
+                  struct timespec *arrival_ts);
+size_t au_limit(off64_t offset, size_t sz);
 
 void sdcard_sendio(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
 void cmd_help(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_flush(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_config(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_discard(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
 void sigterm_handler(int signo);
 
 // profiling.c
@@ -127,10 +346,19 @@ void cmd_profiling_stats(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req
 void cmd_profiling_enable(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
 void cmd_profiling_disable(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
 void cmd_profiling_reset(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_profiling_unit(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void account_request(struct bdev_unit *unit, bool write, off64_t offset, size_t sz,
+                     struct timespec *arrival_ts, struct timespec *start_ts);
+void reset_unit_stats(struct bdev_unit *unit);
 
 // debug.c
 void cmd_debug(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
 void cmd_debug_registers(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_debug_card(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_debug_trace(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_debug_init(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_debug_pio(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
+void cmd_debug_recovery(struct bdev_unit *unit, msgid_t msgid, iorequest_t *req);
 
 
 #endif
@@ -30,11 +30,21 @@
 #include "sdcard.h"
 #include <time.h>
 #include <sys/time.h>
+#include <sys/param.h>
 #include <machine/cheviot_hal.h>
 
 
 struct timer_wait tw;
 
+struct spin_wait sw_command = SPIN_WAIT_INITIALIZER("command");
+struct spin_wait sw_data = SPIN_WAIT_INITIALIZER("data");
+struct spin_wait sw_register = SPIN_WAIT_INITIALIZER("register");
+
+struct spin_wait *spin_waits[] = { &sw_command, &sw_data, &sw_register, NULL };
+
+
+static uint32_t elapsed_usec(struct timespec *start_ts);
+
 
 /*
  * This can put task to sleep, granularity is kernel's timer tick rate.
@@ -102,3 +112,123 @@ int compare_timer(struct timer_wait * tw)
 	}
 }
 
+
+/* @brief   Start waiting for a condition with SPIN_WAIT
+ *
+ * @param   ws, state of the wait
+ * @param   sw, the kind of wait, holds the busy-poll budget and statistics
+ * @param   timeout_usec, time to wait before giving up
+ *
+ * delay_microsecs() sleeps for at least a scheduler tick, so a command
+ * that completes in tens of microseconds took milliseconds when polled
+ * between sleeps. Busy-polling first catches these quickly without
+ * spinning for the whole of the longer waits such as card programming.
+ */
+void spin_wait_begin(struct spin_wait_state *ws, struct spin_wait *sw, uint32_t timeout_usec)
+{
+  ws->sw = sw;
+  ws->timeout_usec = timeout_usec;
+  ws->elapsed_usec = 0;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ws->start_ts);
+}
+
+
+/* @brief   Decide whether to keep waiting, sleeping once the budget is spent
+ *
+ * @param   ws, state of the wait
+ * @return  true to poll the condition again, false if timed out
+ */
+bool spin_wait_continue(struct spin_wait_state *ws)
+{
+  ws->elapsed_usec = elapsed_usec(&ws->start_ts);
+
+  if (ws->elapsed_usec >= ws->timeout_usec) {
+    return false;
+  }
+
+  if (ws->elapsed_usec >= ws->sw->spin_usec) {
+    delay_microsecs(10);
+  }
+
+  return true;
+}
+
+
+/* @brief   Check if a wait is still within its busy-poll budget
+ *
+ * @param   ws, state of the wait
+ * @return  true to poll again, false to block on an interrupt instead
+ *
+ * Used by sd_wait_interrupt() which blocks on the EMMC interrupt rather
+ * than sleeping once the budget is spent.
+ */
+bool spin_wait_spinning(struct spin_wait_state *ws)
+{
+  ws->elapsed_usec = elapsed_usec(&ws->start_ts);
+
+  return ws->elapsed_usec < ws->sw->spin_usec && ws->elapsed_usec < ws->timeout_usec;
+}
+
+
+/* @brief   Finish a wait, updating statistics and the busy-poll budget
+ *
+ * @param   ws, state of the wait
+ * @param   done, true if the condition was met, false on timeout
+ *
+ * The budget is twice the average completion time, so most waits finish
+ * whilst spinning. Waits that usually take longer than SPIN_WAIT_MAX_USEC
+ * keep a small budget to still catch the occasional quick completion.
+ */
+void spin_wait_end(struct spin_wait_state *ws, bool done)
+{
+  struct spin_wait *sw = ws->sw;
+  uint32_t usec;
+
+  if (!done) {
+    sw->timeouts++;
+    return;
+  }
+
+  usec = elapsed_usec(&ws->start_ts);
+
+  if (usec <= sw->spin_usec) {
+    sw->spin_done++;
+  } else {
+    sw->sleep_done++;
+  }
+
+  sw->avg_usec = (sw->avg_usec * 7 + usec) / 8;
+
+  if (sw->avg_usec * 2 <= SPIN_WAIT_MAX_USEC) {
+    sw->spin_usec = MAX(sw->avg_usec * 2, SPIN_WAIT_MIN_USEC);
+  } else if (sw->avg_usec <= SPIN_WAIT_MAX_USEC) {
+    sw->spin_usec = SPIN_WAIT_MAX_USEC;
+  } else {
+    sw->spin_usec = SPIN_WAIT_MIN_USEC;
+  }
+}
+
+
+/* @brief   Clear the statistics of a kind of wait, keeping its budget
+ *
+ */
+void spin_wait_reset(struct spin_wait *sw)
+{
+  sw->spin_done = 0;
+  sw->sleep_done = 0;
+  sw->timeouts = 0;
+}
+
+
+/*
+ *
+ */
+static uint32_t elapsed_usec(struct timespec *start_ts)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+  return (now.tv_sec - start_ts->tv_sec) * 1000000
+         + (now.tv_nsec - start_ts->tv_nsec) / 1000;
+}
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <sys/types.h>
+#include <stdbool.h>
 #include "sdcard.h"
 
 
@@ -35,29 +36,67 @@ struct timer_wait {
 };
 
 
+// @brief   Statistics and adaptive busy-poll budget of a kind of wait
+struct spin_wait {
+  char *name;
+  uint32_t avg_usec;            // moving average of completion time
+  uint32_t spin_usec;           // time to busy-poll before sleeping
+  uint32_t spin_done;           // waits completed whilst busy-polling
+  uint32_t sleep_done;          // waits completed after sleeping or an interrupt
+  uint32_t timeouts;
+};
+
+// @brief   A wait in progress
+struct spin_wait_state {
+  struct spin_wait *sw;
+  struct timespec start_ts;
+  uint32_t timeout_usec;
+  uint32_t elapsed_usec;
+};
+
+#define SPIN_WAIT_MAX_USEC  200     // Longest busy-poll budget
+#define SPIN_WAIT_MIN_USEC  10      // Budget kept for waits that are usually long
+
+#define SPIN_WAIT_INITIALIZER(name) { name, 0, SPIN_WAIT_MAX_USEC, 0, 0, 0 }
+
+
 extern struct timer_wait tw;
+extern struct spin_wait sw_command;
+extern struct spin_wait sw_data;
+extern struct spin_wait sw_register;
+extern struct spin_wait *spin_waits[];
 
 
 int delay_microsecs(int usec);
 uint32_t read_microsecond_timer(void);
 void register_timer(struct timer_wait * tw, unsigned int usec);
 int compare_timer(struct timer_wait * tw);
+void spin_wait_begin(struct spin_wait_state *ws, struct spin_wait *sw, uint32_t timeout_usec);
+bool spin_wait_continue(struct spin_wait_state *ws);
+bool spin_wait_spinning(struct spin_wait_state *ws);
+void spin_wait_end(struct spin_wait_state *ws, bool done);
+void spin_wait_reset(struct spin_wait *sw);
 
 /*
  * Macro to repeatedly poll a "stop_if_true" test until satisfied or the
- * timeout in microseconds elapses. This busy-waits, we could add code to 
- * yield to other tasks/processes.
+ * timeout in microseconds elapses. The test is busy-polled for the budget
+ * learned by the spin_wait "sw", then polled between sleeps of a timer tick.
  */
-#define TIMEOUT_WAIT(stop_if_true, usec)                                       \
+#define SPIN_WAIT(sw, stop_if_true, usec)                                      \
   do {                                                                         \
-    register_timer(&tw, usec);                                                 \
-    do {                                                                       \
-      if (stop_if_true) {                                                      \
-        break;                                                                 \
-      }                                                                        \
-      delay_microsecs(10);                                                     \
-    } while (!compare_timer(&tw));                                             \
+    struct spin_wait_state _ws;                                                \
+    bool _done;                                                                \
+    spin_wait_begin(&_ws, (sw), (usec));                                       \
+    while (!(_done = (stop_if_true)) && spin_wait_continue(&_ws));             \
+    spin_wait_end(&_ws, _done);                                                \
   } while (0);
 
+/*
+ * Macro to wait for controller register changes such as resets and the
+ * clock stabilising.
+ */
+#define TIMEOUT_WAIT(stop_if_true, usec)                                       \
+  SPIN_WAIT(&sw_register, stop_if_true, usec)
+
 #endif
 